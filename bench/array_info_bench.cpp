@@ -0,0 +1,83 @@
+// micro-benchmark of Cursor::read_array_info against reading the array header varint by varint.
+// build and run from the repository root:
+//   g++ -std=c++20 -O2 -I. bench/array_info_bench.cpp -o array_info_bench && ./array_info_bench
+
+#include "wxf_parser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace WXF_PARSER;
+
+// the headers (num_type, rank, dimensions) of many arrays, one after another
+static std::vector<uint8_t> make_headers(const std::vector<std::vector<size_t>>& shapes, const size_t num_headers) {
+	std::vector<uint8_t> buffer;
+	for (size_t i = 0; i < num_headers; i++) {
+		auto& dims = shapes[i % shapes.size()];
+		serialize_varint(buffer, 3); // f64
+		serialize_varint(buffer, dims.size());
+		for (auto dim : dims)
+			serialize_varint(buffer, dim);
+	}
+	return buffer;
+}
+
+// the decoding loops are not inlined into main, so that each is compiled on its own
+[[gnu::noinline]] static size_t sum_varints(const std::vector<uint8_t>& buffer) {
+	size_t sum = 0;
+	Cursor cursor(buffer);
+	while (cursor.pos < cursor.size) {
+		sum += cursor.read_varint();
+		int r = int(cursor.read_varint());
+		size_t all_len = 1;
+		for (int i = 0; i < r; i++)
+			all_len *= cursor.read_varint();
+		sum += r + all_len;
+	}
+	return sum;
+}
+
+[[gnu::noinline]] static size_t sum_array_info(const std::vector<uint8_t>& buffer) {
+	size_t sum = 0;
+	Cursor cursor(buffer);
+	while (cursor.pos < cursor.size) {
+		int num_type, r;
+		size_t dims[Token::inline_rank];
+		size_t all_len;
+		cursor.read_array_info(num_type, r, dims, all_len);
+		sum += num_type + r + all_len;
+	}
+	return sum;
+}
+
+int main() {
+	std::mt19937_64 rng(1);
+	const size_t num_headers = 2000000;
+	const char* names[] = { "vectors {3}", "matrices {4, 4}", "mixed small shapes", "large dimensions {1000, 300}" };
+	std::vector<std::vector<size_t>> shapes[4] = { { { 3 } }, { { 4, 4 } }, {}, { { 1000, 300 } } };
+	for (int i = 0; i < 64; i++)
+		shapes[2].push_back(i % 2 ? std::vector<size_t>{ 1 + rng() % 100 } : std::vector<size_t>{ 1 + rng() % 10, 1 + rng() % 10 });
+
+	for (int kind = 0; kind < 4; kind++) {
+		auto buffer = make_headers(shapes[kind], num_headers);
+		// the best of several rounds, the first one warms up the caches
+		double best0 = 1e9, best1 = 1e9;
+		for (int round = 0; round < 7; round++) {
+			auto t0 = std::chrono::steady_clock::now();
+			size_t sum0 = sum_varints(buffer);
+			auto t1 = std::chrono::steady_clock::now();
+			size_t sum1 = sum_array_info(buffer);
+			auto t2 = std::chrono::steady_clock::now();
+
+			if (sum0 != sum1) {
+				std::printf("%s: the results differ\n", names[kind]);
+				return 1;
+			}
+			best0 = std::min(best0, std::chrono::duration<double, std::nano>(t1 - t0).count() / num_headers);
+			best1 = std::min(best1, std::chrono::duration<double, std::nano>(t2 - t1).count() / num_headers);
+		}
+		std::printf("%-32s read_varint %6.2f ns  read_array_info %6.2f ns\n", names[kind], best0, best1);
+	}
+	return 0;
+}
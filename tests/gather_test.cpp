@@ -0,0 +1,37 @@
+// GatherEncoder must give the same bytes as Encoder, also for payloads built during a push.
+// build and run from the repository root (with -fsanitize=address to catch dangling references):
+//   g++ -std=c++20 -fsanitize=address -I. tests/gather_test.cpp -o gather_test && ./gather_test
+
+#include "wxf_parser.h"
+
+#include <cassert>
+#include <cstdio>
+
+using namespace WXF_PARSER;
+
+template<typename F>
+static void check_same(F&& push) {
+	GatherEncoder gather(64);
+	push(gather);
+	Encoder encoder;
+	push(encoder);
+	assert(gather.to_vector() == encoder.buffer);
+}
+
+int main() {
+	// nested lists are flattened into a temporary before they are pushed
+	check_same([](auto& enc) { enc.push_list(std::vector<std::vector<double>>(100, std::vector<double>(100, 1.5))); });
+	check_same([](auto& enc) { enc.push_list(std::vector<std::vector<int64_t>>(100, std::vector<int64_t>(100, 1000000))); });
+	check_same([](auto& enc) {
+		enc.push_function("f", 2);
+		enc.push_list(std::vector<std::vector<double>>(50, std::vector<double>(20, 2.5)));
+		enc.push_list(std::vector<std::vector<machine_number>>(30, std::vector<machine_number>(10, int64_t(70000))));
+		});
+
+	// large payloads are referenced, small writes from temporaries are copied
+	std::vector<double> data(1000, 0.25);
+	check_same([&](auto& enc) { enc.push_integer(300).push_packed_array({ 1000 }, data).push_string("abc"); });
+
+	std::puts("ok");
+	return 0;
+}
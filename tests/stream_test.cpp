@@ -0,0 +1,66 @@
+// StreamParser must find every message of a stream, also when several arrive in one chunk.
+// build and run from the repository root:
+//   g++ -std=c++20 -fsanitize=address -I. tests/stream_test.cpp -o stream_test -lz && ./stream_test
+
+#define WXF_PARSER_USE_ZLIB
+#include "wxf_parser.h"
+
+#include <cassert>
+#include <cstdio>
+
+using namespace WXF_PARSER;
+
+static std::vector<uint8_t> message(const int64_t n, const bool compressed) {
+	Encoder encoder;
+	encoder.push_ustr(std::vector<uint8_t>{ 56, 58 });
+	encoder.push_function("f", 2).push_integer(n).push_string("message");
+	if (!compressed)
+		return encoder.buffer;
+	// "8C:" and the zlib stream of the body
+	std::vector<uint8_t> res(3 + compressBound(uLong(encoder.buffer.size() - 2)));
+	uLongf len = uLongf(res.size() - 3);
+	compress(res.data() + 3, &len, encoder.buffer.data() + 2, uLong(encoder.buffer.size() - 2));
+	res.resize(3 + len);
+	res[0] = 56; res[1] = 67; res[2] = 58;
+	return res;
+}
+
+// feed the stream in chunks of chunk_size bytes, return the integers of the messages
+static std::vector<int64_t> read_all(const std::vector<uint8_t>& stream, const size_t chunk_size) {
+	std::vector<int64_t> found;
+	auto on_token = [&](const Token& token) {
+		if (token.type == WXF_HEAD::i8 || token.type == WXF_HEAD::i16)
+			found.push_back(token.get_integer());
+		};
+	StreamParser parser;
+	for (size_t pos = 0; pos < stream.size(); pos += chunk_size) {
+		auto len = std::min(chunk_size, stream.size() - pos);
+		parser.feed(std::span<const uint8_t>(stream.data() + pos, len), on_token);
+		assert(parser.err == 0);
+		// the rest of the chunk may hold more messages
+		while (parser.done()) {
+			parser.reset();
+			parser.feed(std::span<const uint8_t>(), on_token);
+			assert(parser.err == 0);
+		}
+	}
+	assert(parser.pending.empty());
+	return found;
+}
+
+int main() {
+	for (int mode = 0; mode < 3; mode++) {
+		std::vector<uint8_t> stream;
+		for (int64_t n = 1; n <= 4; n++) {
+			auto m = message(n, mode == 2 || (mode == 1 && n % 2 == 0));
+			stream.insert(stream.end(), m.begin(), m.end());
+		}
+		for (size_t chunk_size : { size_t(1), size_t(7), stream.size() }) {
+			auto found = read_all(stream, chunk_size);
+			assert((found == std::vector<int64_t>{ 1, 2, 3, 4 }));
+		}
+	}
+
+	std::puts("ok");
+	return 0;
+}
@@ -0,0 +1,41 @@
+// the runtime CompiledTemplate and the compile-time static_template must give the same bytes.
+// build and run from the repository root:
+//   g++ -std=c++20 -I. tests/template_test.cpp -o template_test && ./template_test
+
+#include "wxf_parser.h"
+
+#include <cassert>
+#include <cstdio>
+
+using namespace WXF_PARSER;
+
+template<FullForm::fixed_string Str>
+static void check_same() {
+	constexpr auto& tmpl = static_template<Str>;
+	CompiledTemplate runtime(Str.view());
+	assert(runtime.names.size() == tmpl.names.size());
+
+	// the same value for a placeholder in both, by its name
+	auto fill = [](auto& enc, const std::string_view name) {
+		enc.push_function("value", 1).push_string(name);
+		};
+	Encoder a;
+	tmpl.instantiate(a, [&](Encoder& enc, size_t slot) { fill(enc, tmpl.names[slot]); });
+	Encoder b;
+	runtime.instantiate(b, [&](Encoder& enc, size_t slot) { fill(enc, runtime.names[slot]); });
+	assert(a.buffer == b.buffer);
+}
+
+int main() {
+	check_same<"f[1, -2, 3.5, x, \"s\"]">();
+	check_same<"{1, {2, 3}, {}}">();
+	check_same<"SparseArray[Automatic, #dims, 0, {1, {#rowptr, #colindex}, #vals}]">();
+	// braces inside strings are not lists
+	check_same<"f[\"{x}\"]">();
+	check_same<"{\"{\", \"}\", \"a{b}c\", {\"}{\"}}">();
+	check_same<"f[\"say \\\"{hi}\\\"\", {#a}]">();
+	check_same<"g[\"\\\\\", {1}, \"{\\\\}\"]">();
+
+	std::puts("ok");
+	return 0;
+}
@@ -38,25 +38,59 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
 #include <complex>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <ranges>
+#include <variant>
 #include <vector>
 #include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <unistd.h>
+#define WXF_PARSER_HAS_MMAP 1
+#endif
+
+// write(2) for fd_sink, also where there is no mmap (e.g. MinGW)
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#define WXF_PARSER_HAS_UNISTD 1
+#endif
+
+// compressed WXF ("8C:") needs zlib, define WXF_PARSER_USE_ZLIB and link with -lz
+#ifdef WXF_PARSER_USE_ZLIB
+#include <zlib.h>
+#endif
+
 namespace WXF_PARSER {
 
 	using complex_float_t = std::complex<float>;
 	using complex_double_t = std::complex<double>;
 
-	enum class WXF_HEAD {
+	enum class WXF_HEAD : uint8_t {
 		// function type
 		func = 102,
 		association = 65,
@@ -164,376 +198,1411 @@ namespace WXF_PARSER {
 		buffer.insert(buffer.end(), (uint8_t*)valptr, (uint8_t*)(valptr + len));
 	}
 
-	struct Encoder {
-		std::vector<uint8_t> buffer;
+	// the length of the WXF head: 2 for "8:", 3 for the compressed "8C:",
+	// 0 if the buffer is too short to tell, -1 if it is not WXF
+	inline int wxf_head_length(const uint8_t* buf, const size_t len) {
+		if (len >= 1 && buf[0] != 56)
+			return -1;
+		if (len < 2)
+			return 0;
+		if (buf[1] == 58)
+			return 2;
+		if (buf[1] != 67)
+			return -1;
+		if (len < 3)
+			return 0;
+		return buf[2] == 58 ? 3 : -1;
+	}
 
-		Encoder() = default;
-		~Encoder() = default;
-		Encoder(const Encoder&) = default;
-		Encoder& operator=(const Encoder&) = default;
-		Encoder(Encoder&&) = default;
-		Encoder& operator=(Encoder&&) = default;
+	inline bool is_compressed_wxf(const uint8_t* buf, const size_t len) {
+		return wxf_head_length(buf, len) == 3;
+	}
 
-		void clear() { buffer.clear(); }
+	// the number of chunks to split n items in for parallel_for: a few chunks per thread
+	// for load balancing. chunk c holds the items [n * c / num_chunks, n * (c + 1) / num_chunks)
+	inline size_t parallel_chunks(const size_t n, unsigned num_threads) {
+		if (num_threads == 0)
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		return std::max<size_t>(1, std::min<size_t>(n, size_t(num_threads) * 4));
+	}
 
-		// move from existing buffer
-		Encoder(std::vector<uint8_t>&& buf) : buffer(std::move(buf)) {}
+	// worker threads started once and reused by every parallel_for, so a call does not pay for
+	// creating and joining threads. the threads are added as more are asked for, and one job runs at a time
+	struct thread_pool {
+		std::mutex job_mutex; // held by the caller of run() for the whole job
+		std::mutex mutex; // for the fields below
+		std::condition_variable wake; // a job is waiting for workers, or the pool stops
+		std::condition_variable idle; // the last worker finished the job
+		std::vector<std::thread> workers;
+		const std::function<void()>* job = nullptr;
+		unsigned to_start = 0; // the workers still to join the job
+		unsigned running = 0; // the workers inside the job
+		bool stopping = false;
+
+		// set on the threads running a job, a nested parallel_for there runs serially
+		static bool& inside_job() {
+			static thread_local bool inside = false;
+			return inside;
+		}
+
+		static thread_pool& instance() {
+			static thread_pool pool;
+			return pool;
+		}
+
+		thread_pool() = default;
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+		~thread_pool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& t : workers)
+				t.join();
+		}
+
+		// run fn on num_threads threads, the calling thread included, and wait until all return
+		void run(const unsigned num_threads, const std::function<void()>& fn) {
+			std::lock_guard<std::mutex> job_lock(job_mutex);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				while (workers.size() + 1 < num_threads)
+					workers.emplace_back([this] { work(); });
+				job = &fn;
+				to_start = num_threads - 1;
+			}
+			wake.notify_all();
+
+			inside_job() = true;
+			fn();
+			inside_job() = false;
+
+			// fn shares its work out, so when it returns here nothing is left for the workers not started yet
+			std::unique_lock<std::mutex> lock(mutex);
+			to_start = 0;
+			idle.wait(lock, [this] { return running == 0; });
+			job = nullptr;
+		}
+
+		void work() {
+			inside_job() = true;
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				wake.wait(lock, [this] { return stopping || to_start > 0; });
+				if (stopping)
+					return;
+				to_start--;
+				running++;
+				auto fn = job;
+				lock.unlock();
+				(*fn)();
+				lock.lock();
+				if (--running == 0)
+					idle.notify_all();
+			}
+		}
+	};
+
+	// call fn(c) for every chunk c in [0, num_chunks) on num_threads threads (0 for all cores),
+	// the calling thread included. each thread takes the next chunk from a shared counter.
+	// the threads come from thread_pool::instance()
+	template<typename F>
+	void parallel_for(const size_t num_chunks, unsigned num_threads, F&& fn) {
+		if (num_threads == 0)
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		num_threads = (unsigned)std::min<size_t>(num_threads, num_chunks);
+		if (num_threads <= 1 || thread_pool::inside_job()) {
+			for (size_t c = 0; c < num_chunks; c++)
+				fn(c);
+			return;
+		}
+
+		std::atomic<size_t> next_chunk = 0;
+		std::function<void()> worker = [&]() {
+			for (size_t c = next_chunk++; c < num_chunks; c = next_chunk++)
+				fn(c);
+			};
+		thread_pool::instance().run(num_threads, worker);
+	}
+
+#ifdef WXF_PARSER_USE_ZLIB
+	// compress an uncompressed WXF message ("8:" ...) into the compressed form ("8C:" + zlib stream).
+	// with num_threads > 1 the body is split into blocks of block_size bytes that are deflated in
+	// parallel and joined into one valid zlib stream (the same way as pigz): every block is a raw
+	// deflate stream primed with the last 32K of the previous block and ended by a sync flush,
+	// the checksum is combined from the adler32 of the blocks
+	inline std::vector<uint8_t> compress_wxf(const uint8_t* buf, const size_t len, const int level = Z_DEFAULT_COMPRESSION,
+		unsigned num_threads = 1, size_t block_size = size_t(1) << 20) {
+		std::vector<uint8_t> out;
+		// zlib counts the input of one call in uInt
+		block_size = std::clamp<size_t>(block_size, 32768, size_t(1) << 30);
+		if (wxf_head_length(buf, len) != 2) {
+			std::cerr << "compress_wxf: the input is not uncompressed WXF" << std::endl;
+			return out;
+		}
+		const uint8_t* body = buf + 2;
+		const size_t body_len = len - 2;
+		const size_t num_blocks = std::max<size_t>(1, (body_len + block_size - 1) / block_size);
+
+		// zlib head, 0x78 0x9c: deflate with 32K window, no dictionary
+		out = { 56, 67, 58, 0x78, 0x9c };
+
+		std::vector<std::vector<uint8_t>> blocks(num_blocks);
+		std::vector<uLong> checks(num_blocks);
+		std::atomic<int> failed = 0;
+
+		parallel_for(num_blocks, std::max(1u, num_threads), [&](size_t i) {
+			z_stream zs;
+			std::memset(&zs, 0, sizeof(zs));
+			if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				failed = 1;
+				return;
+			}
+			size_t start = i * block_size;
+			size_t size = std::min(block_size, body_len - start);
+			if (i > 0) {
+				size_t dict = std::min<size_t>(32768, start);
+				if (deflateSetDictionary(&zs, body + start - dict, (uInt)dict) != Z_OK)
+					failed = 1;
+			}
+			auto& block = blocks[i];
+			block.resize(deflateBound(&zs, size) + 16);
+			zs.next_in = (Bytef*)(body + start);
+			zs.avail_in = (uInt)size;
+			zs.next_out = block.data();
+			zs.avail_out = (uInt)block.size();
+			const bool last = i + 1 == num_blocks;
+			int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+			// the whole block must be consumed and flushed in one call: the last block ends the stream,
+			// and a sync flush is only complete if some output space is left
+			if (zs.avail_in != 0 || (last ? ret != Z_STREAM_END : (ret != Z_OK || zs.avail_out == 0)))
+				failed = 1;
+			block.resize(block.size() - zs.avail_out);
+			checks[i] = adler32(adler32(0, nullptr, 0), body + start, (uInt)size);
+			deflateEnd(&zs);
+			});
+
+		if (failed) {
+			std::cerr << "compress_wxf: deflate failed" << std::endl;
+			out.clear();
+			return out;
+		}
+
+		size_t total = out.size() + 4;
+		for (auto& block : blocks)
+			total += block.size();
+		out.reserve(total);
+
+		uLong check = adler32(0, nullptr, 0);
+		for (size_t i = 0; i < num_blocks; i++) {
+			out.insert(out.end(), blocks[i].begin(), blocks[i].end());
+			size_t size = std::min(block_size, body_len - i * block_size);
+			check = adler32_combine(check, checks[i], (z_off_t)size);
+		}
+
+		// adler32 in big endian
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(uint8_t(check >> shift));
+		return out;
+	}
+
+	inline std::vector<uint8_t> compress_wxf(const std::vector<uint8_t>& buf, const int level = Z_DEFAULT_COMPRESSION,
+		unsigned num_threads = 1, const size_t block_size = size_t(1) << 20) {
+		return compress_wxf(buf.data(), buf.size(), level, num_threads, block_size);
+	}
+#endif
+
+	// the number of bytes of a varint
+	constexpr size_t varint_size(uint64_t val) noexcept {
+		size_t n = 1;
+		while (val >= 0x80) {
+			val >>= 7;
+			n++;
+		}
+		return n;
+	}
+
+	// the num_type of elements of type T in a packed (WXF_HEAD::array) or numeric (WXF_HEAD::narray) array,
+	// -1 if T is not allowed there
+	template<typename T>
+	constexpr int array_num_type(const WXF_HEAD type) noexcept {
+		if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+			return minimal_signed_bits(std::numeric_limits<T>::max());
+		else if constexpr (std::is_integral_v<T>)
+			return type == WXF_HEAD::narray ? 16 + minimal_unsigned_bits(std::numeric_limits<T>::max()) : -1;
+		else if constexpr (std::is_same_v<T, float>)
+			return 34;
+		else if constexpr (std::is_same_v<T, double>)
+			return 35;
+		else if constexpr (std::is_same_v<T, complex_float_t>)
+			return 51;
+		else if constexpr (std::is_same_v<T, complex_double_t>)
+			return 52;
+		else
+			return -1;
+	}
+
+	// the encoded bytes of a symbol, built at compile time, so a hot head is pushed by one copy:
+	// enc.push_function(symbols::List, n) or enc.push_function(PrebuiltSymbol("MyHead"), n)
+	struct PrebuiltSymbol {
+		static constexpr size_t max_size = 48;
+		uint8_t bytes[max_size] = {};
+		uint8_t size = 0;
+
+		template<size_t N>
+		consteval explicit PrebuiltSymbol(const char(&name)[N]) {
+			// the name length fits in a one byte varint
+			if (N - 1 + 2 > max_size)
+				throw "PrebuiltSymbol: the name is too long";
+			bytes[0] = (uint8_t)WXF_HEAD::symbol;
+			bytes[1] = (uint8_t)(N - 1);
+			for (size_t i = 0; i + 1 < N; i++)
+				bytes[i + 2] = (uint8_t)name[i];
+			size = (uint8_t)(N + 1);
+		}
+
+		std::string_view name() const { return std::string_view((const char*)bytes + 2, size - 2); }
+	};
+
+	// the common System symbols
+	namespace symbols {
+		inline constexpr PrebuiltSymbol List("List");
+		inline constexpr PrebuiltSymbol Rule("Rule");
+		inline constexpr PrebuiltSymbol RuleDelayed("RuleDelayed");
+		inline constexpr PrebuiltSymbol Association("Association");
+		inline constexpr PrebuiltSymbol Complex("Complex");
+		inline constexpr PrebuiltSymbol Rational("Rational");
+		inline constexpr PrebuiltSymbol Plus("Plus");
+		inline constexpr PrebuiltSymbol Times("Times");
+		inline constexpr PrebuiltSymbol Power("Power");
+		inline constexpr PrebuiltSymbol SparseArray("SparseArray");
+		inline constexpr PrebuiltSymbol Automatic("Automatic");
+		inline constexpr PrebuiltSymbol True("True");
+		inline constexpr PrebuiltSymbol False("False");
+		inline constexpr PrebuiltSymbol Null("Null");
+		inline constexpr PrebuiltSymbol None("None");
+		inline constexpr PrebuiltSymbol All("All");
+		inline constexpr PrebuiltSymbol Missing("Missing");
+		inline constexpr PrebuiltSymbol Indeterminate("Indeterminate");
+		inline constexpr PrebuiltSymbol DirectedInfinity("DirectedInfinity");
+	}
+
+	// a machine integer or real, for lists mixing both, see push_list
+	using machine_number = std::variant<int64_t, double>;
+
+	// the push_* interface shared by all encoders, Derived only needs to provide
+	//   void put(uint8_t byte)
+	//   void write(const uint8_t* data, size_t len)
+	template<typename Derived>
+	struct BasicEncoder {
+		Derived& derived() { return static_cast<Derived&>(*this); }
+
+		// called when an expression starts and when a container of n parts has been opened,
+		// the encoders tracking open-ended functions (see VectorEncoder::begin_function) replace them
+		void on_value() {}
+		void on_container(const size_t) {}
+
+		// data built inside a push_* call (e.g. a flattened list) dies with the call, keep_alive moves
+		// it where it lives as long as the output. only GatherEncoder, which keeps references, needs it
+		template<typename T>
+		std::span<const T> keep_alive(std::vector<T>& data) { return std::span<const T>(data); }
+
+		// the largest write of data that only lives during the call: the byte of put, the varint
+		// and value below, the buffer of write_converted. see GatherEncoder
+		static constexpr size_t scratch_size = 256;
+
+		void write_varint(uint64_t val) {
+			uint8_t temp[10];
+			size_t i = 0;
+
+			do {
+				temp[i] = val & 0x7F;
+				val >>= 7;
+				if (val != 0) temp[i] |= 0x80;
+				++i;
+			} while (val != 0);
+
+			derived().write(temp, i);
+		}
 
-		// push ustr directly
-		Encoder& push_ustr(const std::vector<uint8_t>& str) { buffer.insert(buffer.end(), str.begin(), str.end()); return *this; }
-		Encoder& push_ustr(const std::string_view str) {
-			buffer.insert(buffer.end(), (uint8_t*)str.data(), (uint8_t*)(str.data() + str.size())); return *this;
+		template <typename T>
+		void write_binary(const T& value) {
+			derived().write((const uint8_t*)&value, sizeof(T));
+		}
+
+		// push ustr directly, it counts as one expression in an open-ended function
+		Derived& push_ustr(const std::vector<uint8_t>& str) {
+			derived().on_value(); derived().write(str.data(), str.size()); return derived();
+		}
+		Derived& push_ustr(const std::string_view str) {
+			derived().on_value(); derived().write((const uint8_t*)str.data(), str.size()); return derived();
 		}
 		template<typename T>
-		Encoder& push_ustr(const T* str_ptr, const size_t len) {
-			buffer.insert(buffer.end(), (uint8_t*)str_ptr, (uint8_t*)(str_ptr + len)); return *this;
+		Derived& push_ustr(const T* str_ptr, const size_t len) {
+			derived().on_value(); derived().write((const uint8_t*)str_ptr, len * sizeof(T)); return derived();
 		}
 		template<typename T>
-		Encoder& push_ustr(T* start, T* end) {
-			buffer.insert(buffer.end(), (uint8_t*)start, (uint8_t*)end); return *this;
+		Derived& push_ustr(T* start, T* end) {
+			derived().on_value();
+			derived().write((const uint8_t*)start, (const uint8_t*)end - (const uint8_t*)start); return derived();
 		}
 
-		Encoder& push_integer(const int64_t val) {
+		Derived& push_integer(const int64_t val) {
 			auto num_type = minimal_signed_bits(val);
+			derived().on_value();
 			switch (num_type) {
 			case 0:
-				buffer.push_back((uint8_t)WXF_HEAD::i8);
-				serialize_binary(buffer, (int8_t)val);
+				derived().put((uint8_t)WXF_HEAD::i8);
+				write_binary((int8_t)val);
 				break;
 			case 1:
-				buffer.push_back((uint8_t)WXF_HEAD::i16);
-				serialize_binary(buffer, (int16_t)val);
+				derived().put((uint8_t)WXF_HEAD::i16);
+				write_binary((int16_t)val);
 				break;
 			case 2:
-				buffer.push_back((uint8_t)WXF_HEAD::i32);
-				serialize_binary(buffer, (int32_t)val);
+				derived().put((uint8_t)WXF_HEAD::i32);
+				write_binary((int32_t)val);
 				break;
 			case 3:
-				buffer.push_back((uint8_t)WXF_HEAD::i64);
-				serialize_binary(buffer, val);
+				derived().put((uint8_t)WXF_HEAD::i64);
+				write_binary(val);
 				break;
 			default:
 				break;
 			}
-			return *this;
+			return derived();
 		}
 
-		Encoder& push_real(const double val) {
-			buffer.push_back((uint8_t)WXF_HEAD::f64);
-			serialize_binary(buffer, val);
-			return *this;
+		Derived& push_real(const double val) {
+			derived().on_value();
+			derived().put((uint8_t)WXF_HEAD::f64);
+			write_binary(val);
+			return derived();
 		}
 
 		// push string type struct: string/symbol/bigint/bigreal, default type is string
-		Encoder& push_string(const std::string_view str, const WXF_HEAD type = WXF_HEAD::string) {
-			buffer.push_back((uint8_t)type);
-			serialize_varint(buffer, str.size());
-			return push_ustr(str);
+		Derived& push_string(const std::string_view str, const WXF_HEAD type = WXF_HEAD::string) {
+			derived().on_value();
+			derived().put((uint8_t)type);
+			write_varint(str.size());
+			derived().write((const uint8_t*)str.data(), str.size());
+			return derived();
 		}
 
-		Encoder& push_symbol(const std::string_view sym) { return push_string(sym, WXF_HEAD::symbol); }
-		Encoder& push_bigint(const std::string_view bigint_str) { return push_string(bigint_str, WXF_HEAD::bigint); }
-		Encoder& push_bigreal(const std::string_view bigreal_str) { return push_string(bigreal_str, WXF_HEAD::bigreal); }
-		Encoder& push_binary_string(const std::string_view bin_str) { return push_string(bin_str, WXF_HEAD::binary_string); }
-
-		Encoder& push_function(const std::string_view head, const size_t num_vars) {
-			buffer.push_back((uint8_t)WXF_HEAD::func);
-			serialize_varint(buffer, num_vars);
+		Derived& push_symbol(const std::string_view sym) { return push_string(sym, WXF_HEAD::symbol); }
+		Derived& push_bigint(const std::string_view bigint_str) { return push_string(bigint_str, WXF_HEAD::bigint); }
+		Derived& push_bigreal(const std::string_view bigreal_str) { return push_string(bigreal_str, WXF_HEAD::bigreal); }
+		Derived& push_binary_string(const std::string_view bin_str) { return push_string(bin_str, WXF_HEAD::binary_string); }
+
+		Derived& push_function(const std::string_view head, const size_t num_vars) {
+			derived().on_value();
+			derived().put((uint8_t)WXF_HEAD::func);
+			write_varint(num_vars);
+			// the head and the arguments
+			derived().on_container(num_vars + 1);
 			return push_string(head, WXF_HEAD::symbol);
 		}
 
-		Encoder& push_association(const size_t num_rules) {
-			buffer.push_back((uint8_t)WXF_HEAD::association);
-			serialize_varint(buffer, num_rules);
-			return *this;
+		Derived& push_symbol(const PrebuiltSymbol& sym) {
+			derived().on_value();
+			derived().write(sym.bytes, sym.size);
+			return derived();
+		}
+
+		// the whole function head in one write
+		Derived& push_function(const PrebuiltSymbol& head, const size_t num_vars) {
+			uint8_t temp[11 + PrebuiltSymbol::max_size];
+			size_t i = 0;
+			temp[i++] = (uint8_t)WXF_HEAD::func;
+			uint64_t val = num_vars;
+			do {
+				temp[i] = val & 0x7F;
+				val >>= 7;
+				if (val != 0) temp[i] |= 0x80;
+				++i;
+			} while (val != 0);
+			std::memcpy(temp + i, head.bytes, head.size);
+			derived().on_value();
+			derived().write(temp, i + head.size);
+			derived().on_container(num_vars);
+			return derived();
+		}
+
+		Derived& push_association(const size_t num_rules) {
+			derived().on_value();
+			derived().put((uint8_t)WXF_HEAD::association);
+			write_varint(num_rules);
+			derived().on_container(num_rules);
+			return derived();
 		}
 
-		Encoder& push_rule() { buffer.push_back((uint8_t)WXF_HEAD::rule); return *this; }
-		Encoder& push_delay_rule() { buffer.push_back((uint8_t)WXF_HEAD::delay_rule); return *this; }
+		Derived& push_rule() {
+			derived().on_value(); derived().put((uint8_t)WXF_HEAD::rule); derived().on_container(2); return derived();
+		}
+		Derived& push_delay_rule() {
+			derived().on_value(); derived().put((uint8_t)WXF_HEAD::delay_rule); derived().on_container(2); return derived();
+		}
 
 		// return the total length of the array
 		size_t push_array_info(const std::vector<size_t>& dimension_array, WXF_HEAD type, uint8_t num_type) {
+			return push_array_info(std::span<const size_t>(dimension_array), type, num_type);
+		}
+
+		size_t push_array_info(const std::span<const size_t> dimension_array, WXF_HEAD type, uint8_t num_type) {
 			size_t all_len = 1;
 			// [array_type, num_type, rank, dimensions...]
-			buffer.push_back((uint8_t)type);
-			buffer.push_back(num_type);
-			serialize_varint(buffer, dimension_array.size());
+			derived().on_value();
+			derived().put((uint8_t)type);
+			derived().put(num_type);
+			write_varint(dimension_array.size());
 			for (auto dim : dimension_array) {
-				serialize_varint(buffer, dim);
+				write_varint(dim);
 				all_len *= dim;
 			}
 			return all_len;
 		}
 
 		template<typename T>
-		Encoder& push_array(const std::vector<size_t>& dimension_array, const std::span<T> data, WXF_HEAD type, uint8_t num_type) {
-			// backup current size
-			size_t old_size = buffer.size();
-
-			// [array_type, num_type, rank, dimensions..., data...]
-			auto all_len = push_array_info(dimension_array, type, num_type);
+		Derived& push_array(const std::vector<size_t>& dimension_array, const std::span<T> data, WXF_HEAD type, uint8_t num_type) {
+			size_t all_len = 1;
+			for (auto dim : dimension_array)
+				all_len *= dim;
 
 			if (all_len != data.size()) {
 				std::cerr << "Encoder::push_array: Data size does not match the dimension array." << std::endl;
-				// restore buffer
-				buffer.resize(old_size);
-				return *this;
+				return derived();
 			}
 
+			// [array_type, num_type, rank, dimensions..., data...]
+			push_array_info(dimension_array, type, num_type);
+
 			// push data
-			return push_ustr(data.data(), data.size());
+			derived().write((const uint8_t*)data.data(), data.size() * sizeof(T));
+			return derived();
 		}
 
 		template<typename T>
 			requires std::is_integral_v<T>&& std::is_signed_v<T>
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const T> data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const T> data) {
 			int num_type = minimal_signed_bits(std::numeric_limits<T>::max());
 			return push_array(dimension_array, data, WXF_HEAD::array, num_type);
 		}
 
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const float> data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const float> data) {
 			return push_array(dimension_array, data, WXF_HEAD::array, 34);
 		}
 
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const double> data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const double> data) {
 			return push_array(dimension_array, data, WXF_HEAD::array, 35);
 		}
 
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const complex_float_t> data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const complex_float_t> data) {
 			return push_array(dimension_array, data, WXF_HEAD::array, 51);
 		}
 
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const complex_double_t> data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::span<const complex_double_t> data) {
 			return push_array(dimension_array, data, WXF_HEAD::array, 52);
 		}
 
 		template<typename T>
-		Encoder& push_packed_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data) {
+		Derived& push_packed_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data) {
 			return push_packed_array(dimension_array, std::span<const T>(data));
 		}
 
 		template<typename T>
 			requires std::is_integral_v<T>
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const T> data) {
-			bool is_signed = std::is_signed_v<T>;
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const T> data) {
 			int num_type;
 
-			if (is_signed)
+			if constexpr (std::is_signed_v<T>)
 				num_type = minimal_signed_bits(std::numeric_limits<T>::max());
 			else
 				num_type = 16 + minimal_unsigned_bits(std::numeric_limits<T>::max());
 			return push_array(dimension_array, data, WXF_HEAD::narray, num_type);
 		}
 
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const float> data) {
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const float> data) {
 			return push_array(dimension_array, data, WXF_HEAD::narray, 34);
 		}
 
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const double> data) {
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const double> data) {
 			return push_array(dimension_array, data, WXF_HEAD::narray, 35);
 		}
 
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const complex_float_t> data) {
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const complex_float_t> data) {
 			return push_array(dimension_array, data, WXF_HEAD::narray, 51);
 		}
 
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const complex_double_t> data) {
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::span<const complex_double_t> data) {
 			return push_array(dimension_array, data, WXF_HEAD::narray, 52);
 		}
 
 		template<typename T>
-		Encoder& push_numeric_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data) {
+		Derived& push_numeric_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data) {
 			return push_numeric_array(dimension_array, std::span<const T>(data));
 		}
-	};
 
-	struct Token {
-		WXF_HEAD type;
-		int rank = 0;
-		union {
-			// for number, string, symbol, bigint
-			size_t length;
-			// for array and narray, dimensions[0] is the type, dimensions[1] is the total flatten length
-			// so the length is dimensions is rank + 2
-			size_t* dimensions;
-		};
-		const uint8_t* data; // pointer to the data in the original buffer
+		// write data converted to U, through a small buffer on the stack
+		template<typename U, typename T>
+		void write_converted(const std::span<const T> data) {
+			constexpr size_t chunk = scratch_size / sizeof(U);
+			U temp[chunk];
+			for (size_t i = 0; i < data.size(); i += chunk) {
+				size_t n = std::min(chunk, data.size() - i);
+				for (size_t j = 0; j < n; j++)
+					temp[j] = (U)data[i + j];
+				derived().write((const uint8_t*)temp, n * sizeof(U));
+			}
+		}
+
+		template<typename T>
+		Derived& push_integer_array_as(const std::vector<size_t>& dimension_array, const std::span<const T> data,
+			WXF_HEAD type, uint8_t num_type) {
+			push_array_info(dimension_array, type, num_type);
+			switch (num_type) {
+			case 0: write_converted<int8_t>(data); break;
+			case 1: write_converted<int16_t>(data); break;
+			case 2: write_converted<int32_t>(data); break;
+			case 3: write_converted<int64_t>(data); break;
+			case 16: write_converted<uint8_t>(data); break;
+			case 17: write_converted<uint16_t>(data); break;
+			case 18: write_converted<uint32_t>(data); break;
+			case 19: write_converted<uint64_t>(data); break;
+			default: break;
+			}
+			return derived();
+		}
+
+		// push an array in the narrowest element type holding every value exactly, e.g. int64_t
+		// indices below 128 are sent as int8. the data is scanned once for its minimum and maximum.
+		// type is WXF_HEAD::array (packed) or WXF_HEAD::narray (numeric, may use unsigned types),
+		// doubles are sent as float32 only if allow_float32 and all of them round-trip
+		template<typename T>
+			requires std::is_integral_v<T> || std::is_same_v<T, float> || std::is_same_v<T, double>
+		Derived& push_narrowed_array(const std::vector<size_t>& dimension_array, const std::span<const T> data,
+			const WXF_HEAD type = WXF_HEAD::array, const bool allow_float32 = false) {
+			size_t all_len = 1;
+			for (auto dim : dimension_array)
+				all_len *= dim;
+			if (all_len != data.size()) {
+				std::cerr << "Encoder::push_narrowed_array: Data size does not match the dimension array." << std::endl;
+				return derived();
+			}
+
+			if constexpr (std::is_integral_v<T>) {
+				T min_val = 0, max_val = 0;
+				if (!data.empty())
+					min_val = max_val = data[0];
+				for (auto x : data) {
+					min_val = std::min(min_val, x);
+					max_val = std::max(max_val, x);
+				}
 
-		Token() : type(WXF_HEAD::i8), rank(0), length(0), data(nullptr) {}
-		Token(const WXF_HEAD t, const size_t len, const uint8_t* d) : type(t), rank(0), length(len), data(d) {}
-		Token(const WXF_HEAD t, const std::vector<size_t>& dims, const int num_type, const size_t len, const uint8_t* d) : type(t), data(d) {
-			int r = dims.size();
-			rank = r;
-			dimensions = (size_t*)malloc((r + 2) * sizeof(size_t));
-			dimensions[0] = num_type;
-			dimensions[1] = len;
-			for (auto i = 0; i < r; i++) {
-				dimensions[i + 2] = dims[i];
+				uint8_t num_type;
+				if (type == WXF_HEAD::narray && min_val >= 0)
+					num_type = 16 + minimal_unsigned_bits((uint64_t)max_val);
+				else if constexpr (std::is_unsigned_v<T>)
+					num_type = minimal_pos_signed_bits(max_val);
+				else
+					num_type = std::max(minimal_signed_bits(min_val), minimal_signed_bits(max_val));
+				if (num_type == 4) {
+					std::cerr << "Encoder::push_narrowed_array: the values do not fit in a packed array." << std::endl;
+					return derived();
+				}
+				if (num_type == array_num_type<T>(type))
+					return push_array(dimension_array, data, type, num_type);
+				return push_integer_array_as(dimension_array, data, type, num_type);
+			}
+			else {
+				if constexpr (std::is_same_v<T, double>) {
+					if (allow_float32 && std::all_of(data.begin(), data.end(),
+						[](double x) { return (double)(float)x == x; })) {
+						push_array_info(dimension_array, type, 34);
+						write_converted<float>(data);
+						return derived();
+					}
+				}
+				return push_array(dimension_array, data, type, array_num_type<T>(type));
 			}
 		}
 
-		size_t dim(size_t i) const {
-			if (rank > 0)
-				return dimensions[i + 2];
-			return length;
+		template<typename T>
+		Derived& push_narrowed_packed_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data,
+			const bool allow_float32 = false) {
+			return push_narrowed_array(dimension_array, std::span<const T>(data), WXF_HEAD::array, allow_float32);
 		}
 
-		template<typename T> T* get_ptr() const { return (T*)data; }
+		template<typename T>
+		Derived& push_narrowed_numeric_array(const std::vector<size_t>& dimension_array, const std::vector<T>& data,
+			const bool allow_float32 = false) {
+			return push_narrowed_array(dimension_array, std::span<const T>(data), WXF_HEAD::narray, allow_float32);
+		}
 
-		~Token() {
-			if (type == WXF_HEAD::array || type == WXF_HEAD::narray)
-				free(dimensions);
+		// 1 for integers, 2 for reals, 3 for unsigned integers beyond int64_t,
+		// which have no packed array type
+		template<typename T>
+		static int number_kind(const T& x) {
+			if constexpr (std::is_same_v<T, machine_number>)
+				return x.index() == 0 ? 1 : 2;
+			else if constexpr (std::is_unsigned_v<T> && sizeof(T) >= sizeof(int64_t))
+				return x > (T)INT64_MAX ? 3 : 1;
+			else
+				return std::is_integral_v<T> ? 1 : 2;
 		}
 
-		Token(const Token& other) : type(other.type), rank(other.rank), length(other.length), data(other.data) {
-			if (type == WXF_HEAD::array || type == WXF_HEAD::narray) {
-				dimensions = (size_t*)malloc((rank + 2) * sizeof(size_t));
-				std::memcpy(dimensions, other.dimensions, (rank + 2) * sizeof(size_t));
+		// check that a nested list is rectangular with numbers of one kind, and collect its dimensions
+		template<typename R>
+		static bool list_shape(const R& list, std::vector<size_t>& dims, const size_t depth, int& kind) {
+			using E = std::ranges::range_value_t<R>;
+			size_t len = std::ranges::size(list);
+			if (depth == dims.size())
+				dims.push_back(len);
+			else if (dims[depth] != len)
+				return false;
+
+			if constexpr (std::ranges::range<E>) {
+				for (auto& sub : list)
+					if (!list_shape(sub, dims, depth + 1, kind))
+						return false;
+			}
+			else {
+				for (auto& x : list) {
+					auto k = number_kind(x);
+					if (kind == 0)
+						kind = k;
+					else if (kind != k)
+						return false;
+				}
 			}
+			return true;
 		}
 
-		Token(Token&& other) noexcept : type(other.type), rank(other.rank), length(other.length), data(other.data) {
-			if (type == WXF_HEAD::array || type == WXF_HEAD::narray) {
-				dimensions = other.dimensions;
-				other.dimensions = nullptr;
+		template<typename U, typename R>
+		static void list_flatten(const R& list, std::vector<U>& out) {
+			using E = std::ranges::range_value_t<R>;
+			for (auto& x : list) {
+				if constexpr (std::ranges::range<E>)
+					list_flatten(x, out);
+				else if constexpr (std::is_same_v<E, machine_number>)
+					out.push_back(std::visit([](auto v) { return (U)v; }, x));
+				else
+					out.push_back((U)x);
 			}
 		}
 
-		Token& operator=(const Token& other) {
-			if (this != &other) {
-				type = other.type;
-				rank = other.rank;
-				length = other.length;
-				data = other.data;
-				if (type == WXF_HEAD::array || type == WXF_HEAD::narray) {
-					dimensions = (size_t*)malloc((rank + 2) * sizeof(size_t));
-					std::memcpy(dimensions, other.dimensions, (rank + 2) * sizeof(size_t));
+		// push a list of machine numbers (integers, reals or machine_number), or nested lists of them.
+		// a rectangular list of only integers or only reals is sent as a packed array in the narrowest
+		// integer type, otherwise as List[...] whose sublists are packed where possible.
+		// unsigned values beyond int64_t are sent as big integers in a List[...]
+		template<typename R>
+			requires std::ranges::sized_range<const R>
+		Derived& push_list(const R& list) {
+			using E = std::ranges::range_value_t<R>;
+
+			// a flat contiguous list is sent as it is
+			if constexpr (std::ranges::contiguous_range<const R> && std::is_arithmetic_v<E> && !std::is_same_v<E, bool>) {
+				size_t len = std::ranges::size(list);
+				bool packable = len > 0;
+				if constexpr (std::is_unsigned_v<E> && sizeof(E) >= sizeof(int64_t))
+					packable = packable && std::ranges::all_of(list, [](E x) { return number_kind(x) == 1; });
+				if (packable)
+					return push_narrowed_array({ len }, std::span<const E>(std::ranges::data(list), len));
+			}
+			else {
+				std::vector<size_t> dims;
+				int kind = 0;
+				if (list_shape(list, dims, 0, kind) && (kind == 1 || kind == 2)) {
+					if (kind == 1) {
+						std::vector<int64_t> flat;
+						list_flatten(list, flat);
+						return push_narrowed_array(dims, derived().keep_alive(flat));
+					}
+					std::vector<double> flat;
+					list_flatten(list, flat);
+					return push_packed_array(dims, derived().keep_alive(flat));
 				}
 			}
-			return *this;
-		}
 
-		Token& operator=(Token&& other) noexcept {
-			if (this != &other) {
-				type = other.type;
-				rank = other.rank;
-				length = other.length;
-				data = other.data;
-				if (type == WXF_HEAD::array || type == WXF_HEAD::narray) {
-					dimensions = other.dimensions;
-					other.dimensions = nullptr;
+			push_function(symbols::List, std::ranges::size(list));
+			for (auto& x : list) {
+				if constexpr (std::ranges::range<E>)
+					push_list(x);
+				else if constexpr (std::is_same_v<E, machine_number>) {
+					if (x.index() == 0)
+						push_integer(std::get<int64_t>(x));
+					else
+						push_real(std::get<double>(x));
 				}
+				else if constexpr (std::is_integral_v<E>) {
+					if (number_kind(x) == 3)
+						push_bigint(std::to_string(x));
+					else
+						push_integer(x);
+				}
+				else
+					push_real(x);
 			}
+			return derived();
+		}
+	};
+
+	// an encoder growing a std::vector, the allocator can be customized,
+	// e.g. PmrEncoder allocates from a std::pmr::memory_resource
+	template<typename Allocator>
+	struct VectorEncoder : BasicEncoder<VectorEncoder<Allocator>> {
+		std::vector<uint8_t, Allocator> buffer;
+
+		VectorEncoder() = default;
+		~VectorEncoder() = default;
+		VectorEncoder(const VectorEncoder&) = default;
+		VectorEncoder& operator=(const VectorEncoder&) = default;
+		VectorEncoder(VectorEncoder&&) = default;
+		VectorEncoder& operator=(VectorEncoder&&) = default;
+
+		explicit VectorEncoder(const Allocator& alloc) : buffer(alloc) {}
+
+		void clear() { buffer.clear(); frames.clear(); patches.clear(); }
+
+		void reserve(const size_t n) { buffer.reserve(n); }
+
+		// move from existing buffer
+		VectorEncoder(std::vector<uint8_t, Allocator>&& buf) : buffer(std::move(buf)) {}
+
+		void put(const uint8_t byte) { buffer.push_back(byte); }
+		void write(const uint8_t* data, const size_t len) { buffer.insert(buffer.end(), data, data + len); }
+
+		// write the header of an array and return its payload inside the buffer, to be filled in place
+		// (also by several threads over disjoint slices). the payload starts zeroed, and the span is
+		// invalid after any later push or finish().
+		// the payload follows the header at any byte offset, so the T* of reserve_array may be
+		// misaligned for T (like Token::get_arr_span): this works on x86 and ARM64, which allow unaligned
+		// loads and stores. for portable code take the bytes and write the elements with std::memcpy
+		template<typename T>
+		std::span<uint8_t> reserve_array_bytes(const std::vector<size_t>& dimension_array, const WXF_HEAD type) {
+			auto all_len = this->push_array_info(dimension_array, type, array_num_type<T>(type));
+			auto pos = buffer.size();
+			buffer.resize(pos + all_len * sizeof(T));
+			return std::span<uint8_t>(buffer.data() + pos, all_len * sizeof(T));
+		}
+
+		template<typename T>
+		std::span<T> reserve_array(const std::vector<size_t>& dimension_array, const WXF_HEAD type) {
+			auto bytes = reserve_array_bytes<T>(dimension_array, type);
+			return std::span<T>((T*)bytes.data(), bytes.size() / sizeof(T));
+		}
+
+		template<typename T>
+			requires (array_num_type<T>(WXF_HEAD::array) >= 0)
+		std::span<T> reserve_packed_array(const std::vector<size_t>& dimension_array) {
+			return reserve_array<T>(dimension_array, WXF_HEAD::array);
+		}
+
+		template<typename T>
+			requires (array_num_type<T>(WXF_HEAD::narray) >= 0)
+		std::span<T> reserve_numeric_array(const std::vector<size_t>& dimension_array) {
+			return reserve_array<T>(dimension_array, WXF_HEAD::narray);
+		}
+
+		// push List[...] of n elements encoded in parallel, fn(Encoder& enc, size_t i) pushes the i-th one.
+		// the elements are split into chunks taken by num_threads threads (0 for all cores), each chunk
+		// is encoded into its own Encoder and the chunks are copied in order behind the List header,
+		// so the result is the same as the serial encoding
+		template<typename F>
+		VectorEncoder& push_list_parallel(const size_t n, F&& fn, unsigned num_threads = 0) {
+			using ChunkEncoder = VectorEncoder<std::allocator<uint8_t>>;
+			const size_t num_chunks = parallel_chunks(n, num_threads);
+			std::vector<ChunkEncoder> chunks(num_chunks);
+			parallel_for(num_chunks, num_threads, [&](size_t c) {
+				auto& enc = chunks[c];
+				for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; i++)
+					fn(enc, i);
+				enc.finish();
+				});
+
+			// the List header as one expression, the chunks are written without counting
+			on_value();
+			put((uint8_t)WXF_HEAD::func);
+			this->write_varint(n);
+			write(symbols::List.bytes, symbols::List.size);
+			size_t total = buffer.size();
+			for (auto& enc : chunks)
+				total += enc.buffer.size();
+			buffer.reserve(total);
+			for (auto& enc : chunks)
+				write(enc.buffer.data(), enc.buffer.size());
 			return *this;
 		}
 
-		int64_t get_integer() const {
-			if (type == WXF_HEAD::i8)
-				return *(int8_t*)data;
-			else if (type == WXF_HEAD::i16)
-				return *(int16_t*)data;
-			else if (type == WXF_HEAD::i32)
-				return *(int32_t*)data;
-			else if (type == WXF_HEAD::i64)
-				return *(int64_t*)data;
+		// open-ended functions and associations: begin_function(head), push the arguments,
+		// end_function(), and the argument count is filled in by finish().
+		// no bytes are reserved for the counts, finish() inserts all of them in one backward pass,
+		// so call it after the last end_* and before using the buffer
+		struct open_frame {
+			uint8_t kind;     // 0 for a container of known size, otherwise WXF_HEAD::func/association
+			size_t remaining; // parts left in a container of known size
+			size_t count;     // parts pushed to an open-ended one
+			size_t pos;       // where its count goes
+		};
+		std::vector<open_frame> frames;
+		std::vector<std::pair<size_t, size_t>> patches; // (pos, count)
+
+		void on_value() {
+			// only tracked inside an open-ended function
+			while (!frames.empty() && frames.back().kind == 0 && frames.back().remaining == 0)
+				frames.pop_back();
+			if (frames.empty())
+				return;
+			auto& frame = frames.back();
+			if (frame.kind == 0)
+				frame.remaining--;
 			else
-				return 0;
+				frame.count++;
 		}
 
-		double get_real() const {
-			if (type == WXF_HEAD::f64)
-				return *(double*)data;
-			else
-				return 0;
+		void on_container(const size_t n) {
+			if (!frames.empty() && n > 0)
+				frames.push_back({ 0, n, 0, 0 });
 		}
 
-		std::string_view get_string_view() const {
-			if (type == WXF_HEAD::symbol
-				|| type == WXF_HEAD::bigint
-				|| type == WXF_HEAD::bigreal
-				|| type == WXF_HEAD::string
-				|| type == WXF_HEAD::binary_string) {
-				return std::string_view((const char*)data, length);
-			}
-			else
-				return std::string_view();
+		VectorEncoder& begin_function(const std::string_view head) {
+			on_value();
+			put((uint8_t)WXF_HEAD::func);
+			frames.push_back({ (uint8_t)WXF_HEAD::func, 0, 0, buffer.size() });
+			// the head is not an argument
+			put((uint8_t)WXF_HEAD::symbol);
+			this->write_varint(head.size());
+			write((const uint8_t*)head.data(), head.size());
+			return *this;
 		}
 
-		template<typename T>
-		std::span<const T> get_arr_span() const {
-			if (type != WXF_HEAD::array && type != WXF_HEAD::narray)
-				return std::span<const T>();
-			return std::span<const T>((T*)data, dimensions[1]);
+		VectorEncoder& begin_function(const PrebuiltSymbol& head) {
+			on_value();
+			put((uint8_t)WXF_HEAD::func);
+			frames.push_back({ (uint8_t)WXF_HEAD::func, 0, 0, buffer.size() });
+			write(head.bytes, head.size);
+			return *this;
 		}
 
-		// debug only, print the token info
-		template<typename T>
-		void print(T& ss) const {
-			auto& token = *this;
-			switch (token.type) {
-			case WXF_HEAD::i8:
-				ss << "i8: " << token.get_integer() << std::endl;
-				break;
-			case WXF_HEAD::i16:
-				ss << "i16: " << token.get_integer() << std::endl;
-				break;
-			case WXF_HEAD::i32:
-				ss << "i32: " << token.get_integer() << std::endl;
-				break;
-			case WXF_HEAD::i64:
-				ss << "i64: " << token.get_integer() << std::endl;
-				break;
-			case WXF_HEAD::f64:
-				ss << "f64: " << token.get_real() << std::endl;
-				break;
-			case WXF_HEAD::symbol:
-				ss << "symbol: " << token.get_string_view() << std::endl;
-				break;
-			case WXF_HEAD::bigint:
-				ss << "bigint: " << token.get_string_view() << std::endl;
-				break;
-			case WXF_HEAD::bigreal:
-				ss << "bigreal: " << token.get_string_view() << std::endl;
-				break;
-			case WXF_HEAD::string:
-				ss << "string: " << token.get_string_view() << std::endl;
-				break;
-			case WXF_HEAD::binary_string:
-				ss << "binary_string:" << token.get_string_view() << std::endl;
-				break;
-			case WXF_HEAD::func:
-				ss << "func: " << token.length << " vars" << std::endl;
-				break;
-			case WXF_HEAD::association:
-				ss << "association: " << token.length << " rules" << std::endl;
-				break;
-			case WXF_HEAD::delay_rule:
-				ss << "delay_rule: " << token.length << std::endl;
-				break;
-			case WXF_HEAD::rule:
-				ss << "rule: " << token.length << std::endl;
-				break;
-			case WXF_HEAD::array: {
-				ss << "array: rank = " << token.rank << ", dimensions = ";
-				size_t all_len = token.dimensions[1];
-				for (int i = 0; i < token.rank; i++) {
-					ss << token.dimensions[i + 2] << " ";
-				}
-				ss << std::endl;
+		VectorEncoder& begin_association() {
+			on_value();
+			put((uint8_t)WXF_HEAD::association);
+			frames.push_back({ (uint8_t)WXF_HEAD::association, 0, 0, buffer.size() });
+			return *this;
+		}
 
-				auto num_type = token.dimensions[0];
-				ss << "data: ";
-				if (token.data == nullptr)
-					break;
+		VectorEncoder& end_function() { return end_open(WXF_HEAD::func); }
+		VectorEncoder& end_association() { return end_open(WXF_HEAD::association); }
 
-#define PRINT_ARRAY_CASE(TYPE1, TYPE2) do {                      \
-				for (size_t i = 0; i < all_len; i++) {           \
-					ss << (TYPE2)(get_ptr<TYPE1>()[i]) << " ";   \
-				}} while (0)
+		VectorEncoder& end_open(const WXF_HEAD kind) {
+			while (!frames.empty() && frames.back().kind == 0 && frames.back().remaining == 0)
+				frames.pop_back();
+			if (frames.empty() || frames.back().kind != (uint8_t)kind) {
+				std::cerr << "Encoder::end_open: no matching begin or an unfinished expression." << std::endl;
+				return *this;
+			}
+			patches.emplace_back(frames.back().pos, frames.back().count);
+			frames.pop_back();
+			return *this;
+		}
 
-				switch (num_type) {
-				case 0: PRINT_ARRAY_CASE(int8_t, int64_t); break;
-				case 1: PRINT_ARRAY_CASE(int16_t, int64_t); break;
+		VectorEncoder& finish() {
+			if (patches.empty())
+				return *this;
+			if (std::any_of(frames.begin(), frames.end(), [](auto& f) { return f.kind != 0; })) {
+				std::cerr << "Encoder::finish: there are open functions not ended." << std::endl;
+				return *this;
+			}
+			frames.clear();
+			std::sort(patches.begin(), patches.end());
+
+			size_t extra = 0;
+			for (auto& [pos, count] : patches)
+				extra += varint_size(count);
+			size_t end = buffer.size();
+			buffer.resize(end + extra);
+
+			// from the back, move each segment once to its final place and write the count before it
+			for (size_t i = patches.size(); i-- > 0;) {
+				auto [pos, count] = patches[i];
+				std::memmove(buffer.data() + pos + extra, buffer.data() + pos, end - pos);
+				extra -= varint_size(count);
+				auto ptr = buffer.data() + pos + extra;
+				do {
+					*ptr = count & 0x7F;
+					count >>= 7;
+					if (count != 0) *ptr |= 0x80;
+					ptr++;
+				} while (count != 0);
+				end = pos;
+			}
+			patches.clear();
+			return *this;
+		}
+
+#ifdef WXF_PARSER_USE_ZLIB
+		// the finish step for compressed output: replace the buffer (a complete "8:" message)
+		// by its compressed form "8C:", see compress_wxf.
+		// return false and keep the buffer if it can not be compressed
+		bool compress(const int level = Z_DEFAULT_COMPRESSION, const unsigned num_threads = 1,
+			const size_t block_size = size_t(1) << 20) {
+			auto out = compress_wxf(buffer.data(), buffer.size(), level, num_threads, block_size);
+			if (out.empty())
+				return false;
+			buffer.assign(out.begin(), out.end());
+			return true;
+		}
+#endif
+	};
+
+	using Encoder = VectorEncoder<std::allocator<uint8_t>>;
+	using PmrEncoder = VectorEncoder<std::pmr::polymorphic_allocator<uint8_t>>;
+
+	// writes into memory given by the caller and never allocates.
+	// size counts every byte pushed, when it goes beyond the memory, overflow() is true,
+	// nothing more is written and size tells how much memory is needed
+	struct SpanEncoder : BasicEncoder<SpanEncoder> {
+		std::span<uint8_t> out;
+		size_t size = 0;
+
+		SpanEncoder() = default;
+		SpanEncoder(const std::span<uint8_t> mem) : out(mem) {}
+		SpanEncoder(uint8_t* mem, const size_t len) : out(mem, len) {}
+
+		void clear() { size = 0; }
+		bool overflow() const { return size > out.size(); }
+		// the encoded bytes, empty on overflow
+		std::span<uint8_t> result() const { return overflow() ? std::span<uint8_t>() : out.first(size); }
+
+		void put(const uint8_t byte) {
+			if (size < out.size())
+				out[size] = byte;
+			size++;
+		}
+
+		void write(const uint8_t* data, const size_t len) {
+			// after an overflow, size is beyond the memory and nothing is written
+			if (size + len <= out.size())
+				std::memcpy(out.data() + size, data, len);
+			size += len;
+		}
+	};
+
+	// where SinkEncoder sends its output, return false on failure
+	using sink_function = std::function<bool(const uint8_t* data, size_t len)>;
+
+	inline sink_function ostream_sink(std::ostream& os) {
+		return [&os](const uint8_t* data, size_t len) {
+			os.write((const char*)data, len);
+			return bool(os);
+			};
+	}
+
+#ifdef WXF_PARSER_HAS_UNISTD
+	// write to a file descriptor, retrying partial writes
+	inline sink_function fd_sink(const int fd) {
+		return [fd](const uint8_t* data, size_t len) {
+			while (len > 0) {
+				auto n = ::write(fd, data, len);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					return false;
+				}
+				data += n;
+				len -= n;
+			}
+			return true;
+			};
+	}
+#endif
+
+	// an encoder with bounded memory: the output is staged in a buffer of chunk_size bytes
+	// and flushed to the sink when it is full, large payloads (e.g. packed arrays) are sent
+	// to the sink directly. call flush() at the end (the destructor also does it)
+	struct SinkEncoder : BasicEncoder<SinkEncoder> {
+		sink_function sink;
+		std::vector<uint8_t> chunk;
+		size_t chunk_size;
+		size_t size = 0; // the total number of bytes pushed
+		int err = 0; // 0 is ok, 1 if the sink failed
+
+		SinkEncoder(sink_function s, const size_t chunk_sz = 65536) : sink(std::move(s)), chunk_size(std::max<size_t>(chunk_sz, 16)) {
+			chunk.reserve(chunk_size);
+		}
+		~SinkEncoder() { flush(); }
+		SinkEncoder(const SinkEncoder&) = delete;
+		SinkEncoder& operator=(const SinkEncoder&) = delete;
+
+		void emit(const uint8_t* data, const size_t len) {
+			if (err == 0 && len > 0 && !sink(data, len)) {
+				std::cerr << "SinkEncoder: failed to write to the sink" << std::endl;
+				err = 1;
+			}
+		}
+
+		bool flush() {
+			emit(chunk.data(), chunk.size());
+			chunk.clear();
+			return err == 0;
+		}
+
+		void put(const uint8_t byte) {
+			if (chunk.size() == chunk_size)
+				flush();
+			chunk.push_back(byte);
+			size++;
+		}
+
+		void write(const uint8_t* data, const size_t len) {
+			size += len;
+			if (chunk.size() + len <= chunk_size) {
+				chunk.insert(chunk.end(), data, data + len);
+				return;
+			}
+			flush();
+			if (len >= chunk_size)
+				emit(data, len);
+			else
+				chunk.insert(chunk.end(), data, data + len);
+		}
+	};
+
+	// a scatter-gather encoder: small pieces (heads, varints, numbers) are copied, while
+	// writes of at least min_ref_size bytes (e.g. packed array payloads) are only referenced.
+	// the referenced data must stay alive until the output is written,
+	// so do not push large temporaries. the output is a list of buffers for writev
+	struct GatherEncoder : BasicEncoder<GatherEncoder> {
+		struct segment {
+			const uint8_t* ref; // the referenced data, nullptr for bytes[offset, offset + len)
+			size_t offset;
+			size_t len;
+		};
+		std::vector<uint8_t> bytes; // the copied pieces
+		std::vector<segment> segments;
+		std::vector<std::shared_ptr<const void>> kept; // see keep_alive
+		size_t min_ref_size;
+		size_t size = 0; // the total number of bytes pushed
+
+		// writes up to scratch_size bytes may come from temporaries (put, write_varint, write_binary),
+		// they are always copied whatever min_ref is, a reference to them would dangle
+		GatherEncoder(const size_t min_ref = 4096) : min_ref_size(std::max(min_ref, scratch_size + 1)) {}
+
+		void clear() {
+			bytes.clear();
+			segments.clear();
+			kept.clear();
+			size = 0;
+		}
+
+		// the segments may reference the data, so it is owned by the encoder
+		template<typename T>
+		std::span<const T> keep_alive(std::vector<T>& data) {
+			auto owned = std::make_shared<const std::vector<T>>(std::move(data));
+			kept.push_back(owned);
+			return std::span<const T>(*owned);
+		}
+
+		void put(const uint8_t byte) { write(&byte, 1); }
+
+		void write(const uint8_t* data, const size_t len) {
+			size += len;
+			if (len >= min_ref_size) {
+				segments.push_back({ data, 0, len });
+				return;
+			}
+			// extend the last copied segment
+			if (segments.empty() || segments.back().ref != nullptr)
+				segments.push_back({ nullptr, bytes.size(), 0 });
+			bytes.insert(bytes.end(), data, data + len);
+			segments.back().len += len;
+		}
+
+		// the output in order
+		std::vector<std::span<const uint8_t>> buffers() const {
+			std::vector<std::span<const uint8_t>> res;
+			res.reserve(segments.size());
+			for (auto& seg : segments) {
+				auto ptr = seg.ref != nullptr ? seg.ref : bytes.data() + seg.offset;
+				res.emplace_back(ptr, seg.len);
+			}
+			return res;
+		}
+
+		// copy everything into one buffer
+		std::vector<uint8_t> to_vector() const {
+			std::vector<uint8_t> res;
+			res.reserve(size);
+			for (auto& buf : buffers())
+				res.insert(res.end(), buf.begin(), buf.end());
+			return res;
+		}
+
+#ifdef WXF_PARSER_HAS_MMAP
+		std::vector<iovec> iovecs() const {
+			std::vector<iovec> res;
+			res.reserve(segments.size());
+			for (auto& buf : buffers())
+				res.push_back({ (void*)buf.data(), buf.size() });
+			return res;
+		}
+
+		// write the output with writev, retrying partial writes
+		bool writev(const int fd) const {
+#ifdef IOV_MAX
+			constexpr size_t max_iov = IOV_MAX;
+#else
+			constexpr size_t max_iov = 1024;
+#endif
+			auto iov = iovecs();
+			size_t i = 0;
+			while (i < iov.size()) {
+				auto n = ::writev(fd, iov.data() + i, (int)std::min(iov.size() - i, max_iov));
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					return false;
+				}
+				// skip the written buffers
+				size_t done = n;
+				while (i < iov.size() && done >= iov[i].iov_len) {
+					done -= iov[i].iov_len;
+					i++;
+				}
+				if (i < iov.size()) {
+					iov[i].iov_base = (uint8_t*)iov[i].iov_base + done;
+					iov[i].iov_len -= done;
+				}
+			}
+			return true;
+		}
+#endif
+	};
+
+	// an encoder that only counts the bytes, it has the same push_* interface as Encoder,
+	// so the same code can compute the exact size before the real encoding
+	struct SizeCounter : BasicEncoder<SizeCounter> {
+		size_t size = 0;
+
+		void clear() { size = 0; }
+		void put(const uint8_t) { size++; }
+		void write(const uint8_t*, const size_t len) { size += len; }
+	};
+
+	// run f(encoder) twice: first on a SizeCounter, then on an Encoder reserved
+	// with the exact size, f should be generic, e.g. [&](auto& enc) { enc.push_xxx(...); }
+	template<typename F>
+	Encoder encode_exact(F&& f) {
+		SizeCounter counter;
+		f(counter);
+		Encoder encoder;
+		encoder.reserve(counter.size);
+		f(encoder);
+		return encoder;
+	}
+
+	struct Token {
+		// arrays up to this rank keep their dimensions inside the token
+		static constexpr int inline_rank = 2;
+
+		WXF_HEAD type;
+		uint8_t num_type = 0; // for array and narray only, see size_of_arr_num_type
+		int rank = 0;
+		// for number, string, symbol, bigint: the length in bytes
+		// for function and association: the number of arguments
+		// for array and narray: the total flatten length
+		size_t length;
+		const uint8_t* data; // pointer to the data in the original buffer
+
+		// for function, association and rules parsed in tape mode
+		struct tape_info {
+			size_t next; // the index of the token after the whole sub-expression, 0 if unknown
+			size_t end; // the offset in the buffer after the whole sub-expression
+		};
+
+		union {
+			// rank <= inline_rank: the dimensions
+			size_t inline_dims[inline_rank]; // read them with dim(i)
+			// rank > inline_rank: the varint encoded dimensions in the original buffer
+			const uint8_t* dims_ptr;
+			tape_info tape;
+		};
+
+		Token() : type(WXF_HEAD::i8), rank(0), length(0), data(nullptr), tape{ 0, 0 } {}
+		Token(const WXF_HEAD t, const size_t len, const uint8_t* d) : type(t), rank(0), length(len), data(d), tape{ 0, 0 } {}
+		// dims_ptr points to the first (varint) dimension in the buffer, and dims holds the
+		// first min(rank, inline_rank) of them already decoded
+		Token(const WXF_HEAD t, const int num_type, const int r, const size_t* dims, const uint8_t* dims_src, const size_t len, const uint8_t* d)
+			: type(t), num_type(uint8_t(num_type)), rank(r), length(len), data(d) {
+			if (r <= inline_rank) {
+				for (int i = 0; i < r; i++)
+					inline_dims[i] = dims[i];
+			}
+			else {
+				dims_ptr = dims_src;
+			}
+		}
+
+		size_t dim(size_t i) const {
+			if (rank == 0)
+				return length;
+			if (rank <= inline_rank)
+				return inline_dims[i];
+
+			// decode the dimensions from the original buffer
+			const uint8_t* ptr = dims_ptr;
+			size_t val = 0;
+			for (size_t k = 0; k <= i; k++) {
+				val = 0;
+				int shift = 0;
+				uint8_t b;
+				do {
+					b = *ptr++;
+					val |= size_t(b & 0x7F) << shift;
+					shift += 7;
+				} while (b & 0x80);
+			}
+			return val;
+		}
+
+		// the layout of the former size_t* dimensions member, for code written against it:
+		// { num_type, length, dim(0), ..., dim(rank - 1) }
+		std::vector<size_t> legacy_dimensions() const {
+			std::vector<size_t> res;
+			res.reserve(rank + 2);
+			res.push_back(num_type);
+			res.push_back(length);
+			for (int i = 0; i < rank; i++)
+				res.push_back(dim(i));
+			return res;
+		}
+
+		template<typename T> T* get_ptr() const { return (T*)data; }
+
+		// the number of sub-expressions following this token,
+		// the head of a function is also counted
+		size_t num_subexprs() const {
+			switch (type) {
+			case WXF_HEAD::func:
+				return length + 1;
+			case WXF_HEAD::association:
+				return length;
+			case WXF_HEAD::delay_rule:
+			case WXF_HEAD::rule:
+				return 2;
+			default:
+				return 0;
+			}
+		}
+
+		int64_t get_integer() const {
+			if (type == WXF_HEAD::i8)
+				return *(int8_t*)data;
+			else if (type == WXF_HEAD::i16)
+				return *(int16_t*)data;
+			else if (type == WXF_HEAD::i32)
+				return *(int32_t*)data;
+			else if (type == WXF_HEAD::i64)
+				return *(int64_t*)data;
+			else
+				return 0;
+		}
+
+		double get_real() const {
+			if (type == WXF_HEAD::f64)
+				return *(double*)data;
+			else
+				return 0;
+		}
+
+		std::string_view get_string_view() const {
+			if (type == WXF_HEAD::symbol
+				|| type == WXF_HEAD::bigint
+				|| type == WXF_HEAD::bigreal
+				|| type == WXF_HEAD::string
+				|| type == WXF_HEAD::binary_string) {
+				return std::string_view((const char*)data, length);
+			}
+			else
+				return std::string_view();
+		}
+
+		template<typename T>
+		std::span<const T> get_arr_span() const {
+			if (type != WXF_HEAD::array && type != WXF_HEAD::narray)
+				return std::span<const T>();
+			return std::span<const T>((T*)data, length);
+		}
+
+		// debug only, print the token info
+		template<typename T>
+		void print(T& ss) const {
+			auto& token = *this;
+			switch (token.type) {
+			case WXF_HEAD::i8:
+				ss << "i8: " << token.get_integer() << std::endl;
+				break;
+			case WXF_HEAD::i16:
+				ss << "i16: " << token.get_integer() << std::endl;
+				break;
+			case WXF_HEAD::i32:
+				ss << "i32: " << token.get_integer() << std::endl;
+				break;
+			case WXF_HEAD::i64:
+				ss << "i64: " << token.get_integer() << std::endl;
+				break;
+			case WXF_HEAD::f64:
+				ss << "f64: " << token.get_real() << std::endl;
+				break;
+			case WXF_HEAD::symbol:
+				ss << "symbol: " << token.get_string_view() << std::endl;
+				break;
+			case WXF_HEAD::bigint:
+				ss << "bigint: " << token.get_string_view() << std::endl;
+				break;
+			case WXF_HEAD::bigreal:
+				ss << "bigreal: " << token.get_string_view() << std::endl;
+				break;
+			case WXF_HEAD::string:
+				ss << "string: " << token.get_string_view() << std::endl;
+				break;
+			case WXF_HEAD::binary_string:
+				ss << "binary_string:" << token.get_string_view() << std::endl;
+				break;
+			case WXF_HEAD::func:
+				ss << "func: " << token.length << " vars" << std::endl;
+				break;
+			case WXF_HEAD::association:
+				ss << "association: " << token.length << " rules" << std::endl;
+				break;
+			case WXF_HEAD::delay_rule:
+				ss << "delay_rule: " << token.length << std::endl;
+				break;
+			case WXF_HEAD::rule:
+				ss << "rule: " << token.length << std::endl;
+				break;
+			case WXF_HEAD::array: {
+				ss << "array: rank = " << token.rank << ", dimensions = ";
+				size_t all_len = token.length;
+				for (int i = 0; i < token.rank; i++) {
+					ss << token.dim(i) << " ";
+				}
+				ss << std::endl;
+
+				int num_type = token.num_type;
+				ss << "data: ";
+				if (token.data == nullptr)
+					break;
+
+#define PRINT_ARRAY_CASE(TYPE1, TYPE2) do {                      \
+				for (size_t i = 0; i < all_len; i++) {           \
+					ss << (TYPE2)(get_ptr<TYPE1>()[i]) << " ";   \
+				}} while (0)
+
+				switch (num_type) {
+				case 0: PRINT_ARRAY_CASE(int8_t, int64_t); break;
+				case 1: PRINT_ARRAY_CASE(int16_t, int64_t); break;
 				case 2: PRINT_ARRAY_CASE(int32_t, int64_t); break;
 				case 3: PRINT_ARRAY_CASE(int64_t, int64_t); break;
 				case 34: PRINT_ARRAY_CASE(float, double); break;
@@ -548,12 +1617,12 @@ namespace WXF_PARSER {
 			case WXF_HEAD::narray: {
 				ss << "narray: rank = " << token.rank << ", dimensions = ";
 				for (int i = 0; i < token.rank; i++) {
-					ss << token.dimensions[i + 2] << " ";
+					ss << token.dim(i) << " ";
 				}
 				ss << std::endl;
 
-				size_t num_type = token.dimensions[0];
-				size_t all_len = token.dimensions[1];
+				int num_type = token.num_type;
+				size_t all_len = token.length;
 
 				ss << "data: ";
 				if (token.data == nullptr)
@@ -588,126 +1657,746 @@ namespace WXF_PARSER {
 		}
 	};
 
-	struct Parser {
-		const uint8_t* buffer; // the buffer to read
-		size_t pos = 0;
-		size_t size = 0; // the size of the buffer
-		int err = 0; // 0 is ok, otherwise error
-		std::vector<Token> tokens;
-
-		Parser(const uint8_t* buf, const size_t len) : buffer(buf), pos(0), size(len), err(0) {}
-		Parser(const std::vector<uint8_t>& buf) : buffer(buf.data()), pos(0), size(buf.size()), err(0) {}
-		Parser(const std::string_view buf) : buffer((const uint8_t*)buf.data()), pos(0), size(buf.size()), err(0) {}
-
-		// default special member functions
-		Parser() = default;
-		~Parser() = default;
-		Parser(const Parser&) = default;
-		Parser& operator=(const Parser&) = default;
-		Parser(Parser&&) noexcept = default;
-		Parser& operator=(Parser&&) noexcept = default;
+	static_assert(std::is_trivially_copyable_v<Token>, "Token should be trivially copyable");
 
-		inline uint64_t read_varint() {
-			const uint8_t* ptr = buffer + pos;
-			const uint8_t* end = buffer + size;
-			uint64_t result = 0;
-			uint8_t b;
+	// a monotonic memory resource for decoding, deallocate does nothing and
+	// reset() rewinds to the first block, all blocks are kept for the next use
+	struct Arena : std::pmr::memory_resource {
+		struct block {
+			void* ptr;
+			size_t size;
+		};
+		std::vector<block> blocks;
+		size_t current = 0; // the block in use
+		size_t offset = 0; // the used bytes in the current block
+		size_t next_size = 4096; // the size of the next new block
+
+		Arena() = default;
+		Arena(const size_t initial_size) : next_size(initial_size) {}
+		~Arena() { release(); }
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		// O(1), all memory allocated from the arena is invalid after reset
+		void reset() {
+			current = 0;
+			offset = 0;
+		}
 
-			if (ptr >= end) return 0;
+		// give the memory back to the system
+		void release() {
+			for (auto& b : blocks)
+				::operator delete(b.ptr);
+			blocks.clear();
+			reset();
+		}
 
-			b = *ptr++; result = uint64_t(b & 0x7F);         if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 7;   if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 14;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 21;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 28;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 35;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 42;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 49;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 56;  if (!(b & 0x80) || ptr >= end) goto done;
-			b = *ptr++; result |= uint64_t(b & 0x7F) << 63;
-		done:
-			pos = ptr - buffer;
-			return result;
+		size_t capacity() const {
+			size_t total = 0;
+			for (auto& b : blocks)
+				total += b.size;
+			return total;
 		}
 
-		void parse() {
-			// check the file head
-			if (pos == 0) {
-				if (size < 2 || buffer[0] != 56 || buffer[1] != 58) {
-					std::cerr << "Invalid WXF file" << std::endl;
-					err = 1;
-					return;
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment) override {
+			for (; current < blocks.size(); current++, offset = 0) {
+				auto& b = blocks[current];
+				void* ptr = (uint8_t*)b.ptr + offset;
+				size_t space = b.size - offset;
+				if (std::align(alignment, bytes, ptr, space)) {
+					offset = b.size - space + bytes;
+					return ptr;
 				}
-				pos = 2;
 			}
 
-			while (pos < size) {
-				WXF_HEAD type = (WXF_HEAD)(buffer[pos]); pos++;
+			// no block is large enough, allocate a new one
+			size_t size = std::max(next_size, bytes + alignment);
+			next_size = size * 2;
+			blocks.push_back({ ::operator new(size), size });
+			current = blocks.size() - 1;
+			offset = 0;
+			return do_allocate(bytes, alignment);
+		}
 
-				if (pos == size)
-					break;
+		void do_deallocate(void*, size_t, size_t) override {}
 
-				switch (type) {
-				case WXF_HEAD::i8:
-				case WXF_HEAD::i16:
-				case WXF_HEAD::i32:
-				case WXF_HEAD::i64:
-				case WXF_HEAD::f64: {
-					auto length = size_of_head_num_type(type);
-					tokens.emplace_back(type, length, buffer + pos);
-					pos += length;
-					break;
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+			return this == &other;
+		}
+	};
+
+#ifdef WXF_PARSER_USE_ZLIB
+	// streaming zlib decompression for compressed WXF ("8C:" followed by a zlib stream),
+	// the state and the output buffer are reused after reset()
+	struct Inflater {
+		z_stream zs;
+		bool finished = false; // the end of the zlib stream is reached
+		int err = Z_OK; // the last error of zlib
+		size_t used = 0; // the bytes of the last chunk read by inflate(), the rest follows the stream
+		std::vector<uint8_t> out_buffer; // for the streaming output
+		// zlib counts the input and output of one call in uInt, longer buffers go in windows
+		static constexpr size_t max_window = std::numeric_limits<uInt>::max();
+
+		Inflater(const size_t chunk_size = 65536) : out_buffer(chunk_size) {
+			std::memset(&zs, 0, sizeof(zs));
+			err = inflateInit(&zs);
+		}
+		~Inflater() { inflateEnd(&zs); }
+		Inflater(const Inflater&) = delete;
+		Inflater& operator=(const Inflater&) = delete;
+
+		void reset() {
+			inflateReset(&zs);
+			finished = false;
+			err = Z_OK;
+		}
+
+		// inflate a chunk of the zlib stream, on_output(std::span<const uint8_t>) is called for
+		// every filled output block, the block is only valid during the call
+		template<typename F>
+		bool inflate(const std::span<const uint8_t> chunk, F&& on_output) {
+			used = 0;
+			if (err != Z_OK)
+				return false;
+			size_t in_pos = 0;
+			do {
+				size_t in_size = std::min(chunk.size() - in_pos, max_window);
+				zs.next_in = (Bytef*)(chunk.data() + in_pos);
+				zs.avail_in = (uInt)in_size;
+				in_pos += in_size;
+				while (!finished) {
+					zs.next_out = out_buffer.data();
+					zs.avail_out = (uInt)std::min(out_buffer.size(), max_window);
+					size_t out_size = zs.avail_out;
+					int ret = ::inflate(&zs, Z_NO_FLUSH);
+					size_t produced = out_size - zs.avail_out;
+					if (produced > 0)
+						on_output(std::span<const uint8_t>(out_buffer.data(), produced));
+					if (ret == Z_STREAM_END)
+						finished = true;
+					else if (ret == Z_BUF_ERROR)
+						break; // need more input
+					else if (ret != Z_OK) {
+						err = ret;
+						return false;
+					}
+					if (zs.avail_in == 0 && zs.avail_out != 0)
+						break;
 				}
-				case WXF_HEAD::symbol:
-				case WXF_HEAD::bigint:
-				case WXF_HEAD::bigreal:
-				case WXF_HEAD::string:
-				case WXF_HEAD::binary_string: {
-					auto length = read_varint();
-					tokens.emplace_back(type, length, buffer + pos);
-					pos += length;
-					break;
+			} while (in_pos < chunk.size() && !finished);
+			used = finished ? in_pos - zs.avail_in : chunk.size();
+			return true;
+		}
+
+		// inflate a whole compressed WXF buffer into out as uncompressed WXF (with the "8:" head),
+		// the capacity of out is reused
+		bool inflate_wxf(const uint8_t* buf, const size_t len, std::vector<uint8_t>& out) {
+			out.assign({ 56, 58 });
+			if (!is_compressed_wxf(buf, len))
+				return false;
+			reset();
+			out.resize(std::max(out.capacity(), 4 * len + 64));
+			size_t used = 2;
+			size_t in_pos = 3;
+			while (true) {
+				if (zs.avail_in == 0) {
+					size_t in_size = std::min(len - in_pos, max_window);
+					zs.next_in = (Bytef*)(buf + in_pos);
+					zs.avail_in = (uInt)in_size;
+					in_pos += in_size;
 				}
-				case WXF_HEAD::func:
-				case WXF_HEAD::association: {
-					auto length = read_varint();
-					tokens.emplace_back(type, length, buffer + pos);
+				if (used == out.size())
+					out.resize(out.size() * 2);
+				zs.next_out = out.data() + used;
+				zs.avail_out = (uInt)std::min(out.size() - used, max_window);
+				int ret = ::inflate(&zs, Z_NO_FLUSH);
+				used = zs.next_out - out.data();
+				if (ret == Z_STREAM_END)
 					break;
+				if (ret != Z_OK) {
+					err = ret;
+					out.resize(2);
+					return false;
 				}
-				case WXF_HEAD::delay_rule:
-				case WXF_HEAD::rule:
-					tokens.emplace_back(type, size_t(2), buffer + pos);
-					break;
-				case WXF_HEAD::array:
-				case WXF_HEAD::narray: {
-					int num_type = read_varint();
-					auto r = read_varint();
-					std::vector<size_t> dims(r);
-					size_t all_len = 1;
-					for (size_t i = 0; i < r; i++) {
-						dims[i] = read_varint();
-						all_len *= dims[i];
-					}
-					tokens.emplace_back(type, dims, num_type, all_len, buffer + pos);
-					pos += all_len * size_of_arr_num_type(num_type);
-					break;
+			}
+			finished = true;
+			out.resize(used);
+			return true;
+		}
+	};
+#endif
+
+	// access hints for the pages of a MappedFile, they can be combined
+	enum map_advice : int {
+		map_normal = 0,
+		map_sequential = 1, // MADV_SEQUENTIAL
+		map_willneed = 2 // MADV_WILLNEED
+	};
+
+	// a read-only file mapped into memory, the tokens decoded from it point
+	// directly into the page cache. where mmap is not available, the file is read into memory
+	struct MappedFile {
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		int err = 0; // 0 is ok, otherwise the errno of the failed call
+#ifndef WXF_PARSER_HAS_MMAP
+		std::vector<uint8_t> storage;
+#endif
+
+		MappedFile() = default;
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		explicit MappedFile(const std::filesystem::path& path, const int advice = map_sequential) {
+#ifdef WXF_PARSER_HAS_MMAP
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				err = errno;
+				std::cerr << "Cannot open file " << path << std::endl;
+				return;
+			}
+			struct stat st;
+			if (::fstat(fd, &st) != 0) {
+				err = errno;
+				::close(fd);
+				return;
+			}
+			size = st.st_size;
+			if (size > 0) {
+				void* ptr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (ptr == MAP_FAILED) {
+					err = errno;
+					std::cerr << "Cannot map file " << path << std::endl;
+					size = 0;
 				}
-				default:
-					std::cerr << "Unknown head type: " << (int)type << " pos: " << pos << std::endl;
-					err = 2;
-					break;
+				else {
+					data = (const uint8_t*)ptr;
+					if (advice & map_sequential)
+						::madvise(ptr, size, MADV_SEQUENTIAL);
+					if (advice & map_willneed)
+						::madvise(ptr, size, MADV_WILLNEED);
+				}
+			}
+			// the mapping stays valid after the file is closed
+			::close(fd);
+#else
+			(void)advice;
+			std::ifstream file(path, std::ios::binary);
+			if (!file) {
+				err = ENOENT;
+				std::cerr << "Cannot open file " << path << std::endl;
+				return;
+			}
+			storage.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			data = storage.data();
+			size = storage.size();
+#endif
+		}
+
+		~MappedFile() {
+#ifdef WXF_PARSER_HAS_MMAP
+			if (data != nullptr)
+				::munmap((void*)data, size);
+#endif
+		}
+
+		std::span<const uint8_t> span() const { return std::span<const uint8_t>(data, size); }
+	};
+
+	// a forward-only reader over a WXF buffer, it reads one token at a time
+	// into `token` and never stores more than that, the data of the token points
+	// into the buffer
+	struct Cursor {
+		const uint8_t* buffer = nullptr; // the buffer to read
+		size_t pos = 0;
+		size_t size = 0; // the size of the buffer
+		// 0 is ok, 1 is an invalid WXF head, 2 is an unknown type,
+		// 3 is an incomplete token at the end of the buffer,
+		// 4 is an array whose size overflows size_t
+		int err = 0;
+		Token token; // the current token
+		bool check_head = true; // check the WXF head "8:" at the beginning of the buffer
+
+		Cursor(const uint8_t* buf, const size_t len) : buffer(buf), pos(0), size(len), err(0) {}
+		Cursor(const std::vector<uint8_t>& buf) : buffer(buf.data()), pos(0), size(buf.size()), err(0) {}
+		Cursor(const std::string_view buf) : buffer((const uint8_t*)buf.data()), pos(0), size(buf.size()), err(0) {}
+
+		// default special member functions
+		Cursor() = default;
+		~Cursor() = default;
+		Cursor(const Cursor&) = default;
+		Cursor& operator=(const Cursor&) = default;
+		Cursor(Cursor&&) noexcept = default;
+		Cursor& operator=(Cursor&&) noexcept = default;
+
+		void reset(const uint8_t* buf, const size_t len) {
+			buffer = buf;
+			pos = 0;
+			size = len;
+			err = 0;
+		}
+
+		inline uint64_t read_varint() {
+			const uint8_t* ptr = buffer + pos;
+			const uint8_t* end = buffer + size;
+			uint64_t result = 0;
+			uint8_t b;
+
+			if (ptr >= end) { err = 3; return 0; }
+
+			b = *ptr++; result = uint64_t(b & 0x7F);         if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 7;   if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 14;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 21;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 28;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 35;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 42;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 49;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 56;  if (!(b & 0x80) || ptr >= end) goto done;
+			b = *ptr++; result |= uint64_t(b & 0x7F) << 63;
+		done:
+			// the buffer ends in the middle of the varint
+			if ((b & 0x80) && ptr >= end)
+				err = 3;
+			pos = ptr - buffer;
+			return result;
+		}
+
+		// read num_type, rank and the dimensions of an array, the first inline_rank dimensions
+		// are stored in dims. return the position of the first dimension in the buffer
+		const uint8_t* read_array_info(int& num_type, int& r, size_t* dims, size_t& all_len) {
+			// small arrays: num_type, rank and all dimensions are single bytes in one word
+			if constexpr (std::endian::native == std::endian::little) {
+				if (pos + 8 <= size) {
+					uint64_t word;
+					std::memcpy(&word, buffer + pos, 8);
+					r = int((word >> 8) & 0xFF);
+					if (r <= Token::inline_rank) {
+						uint64_t used = (uint64_t(1) << (8 * (r + 2))) - 1;
+						if ((word & used & 0x8080808080808080ULL) == 0) {
+							num_type = int(word & 0xFF);
+							all_len = 1;
+							for (int i = 0; i < r; i++) {
+								dims[i] = (word >> (8 * (i + 2))) & 0xFF;
+								all_len *= dims[i];
+							}
+							pos += r + 2;
+							return buffer + pos - r;
+						}
+					}
+				}
+			}
+
+			num_type = int(read_varint());
+			r = int(read_varint());
+			const uint8_t* dims_src = buffer + pos;
+			all_len = 1;
+			for (int i = 0; i < r && err == 0; i++) {
+				auto d = read_varint();
+				if (i < Token::inline_rank)
+					dims[i] = d;
+				if (d != 0 && all_len > SIZE_MAX / d)
+					err = 4;
+				all_len *= d;
+			}
+			return dims_src;
+		}
+
+		// check the WXF head "8:", it is done by next() at the beginning of the buffer
+		bool read_head() {
+			if (size < 2 || buffer[0] != 56 || buffer[1] != 58) {
+				if (size == 0 || (size == 1 && buffer[0] == 56)) {
+					err = 3;
+					return false;
 				}
+				std::cerr << "Invalid WXF file" << std::endl;
+				err = 1;
+				return false;
+			}
+			pos = 2;
+			return true;
+		}
+
+		// skip the payload of the current token, it must fit in the rest of the buffer
+		void advance(size_t length) {
+			if (err != 0)
+				return;
+			if (length > size - pos)
+				err = 3;
+			else
+				pos += length;
+		}
+
+		// read the next token, return false at the end of the buffer or on error.
+		// for function, association and rules, only the head part is read
+		// and the next token is the first sub-expression.
+		// on error, pos stays at the beginning of the bad token
+		bool next() {
+			if (err != 0)
+				return false;
+			if (pos == 0 && check_head && !read_head())
+				return false;
+			if (pos >= size)
+				return false;
+
+			const size_t start = pos;
+			WXF_HEAD type = (WXF_HEAD)(buffer[pos]); pos++;
+
+			switch (type) {
+			case WXF_HEAD::i8:
+			case WXF_HEAD::i16:
+			case WXF_HEAD::i32:
+			case WXF_HEAD::i64:
+			case WXF_HEAD::f64: {
+				auto length = size_of_head_num_type(type);
+				token = Token(type, length, buffer + pos);
+				advance(length);
+				break;
+			}
+			case WXF_HEAD::symbol:
+			case WXF_HEAD::bigint:
+			case WXF_HEAD::bigreal:
+			case WXF_HEAD::string:
+			case WXF_HEAD::binary_string: {
+				auto length = read_varint();
+				token = Token(type, length, buffer + pos);
+				advance(length);
+				break;
+			}
+			case WXF_HEAD::func:
+			case WXF_HEAD::association: {
+				auto length = read_varint();
+				token = Token(type, length, buffer + pos);
+				break;
+			}
+			case WXF_HEAD::delay_rule:
+			case WXF_HEAD::rule:
+				token = Token(type, size_t(2), buffer + pos);
+				break;
+			case WXF_HEAD::array:
+			case WXF_HEAD::narray: {
+				int num_type, r;
+				size_t dims[Token::inline_rank];
+				size_t all_len;
+				const uint8_t* dims_src = read_array_info(num_type, r, dims, all_len);
+				token = Token(type, num_type, r, dims, dims_src, all_len, buffer + pos);
+				size_t elem_size = size_of_arr_num_type(num_type);
+				if (elem_size != 0 && all_len > SIZE_MAX / elem_size)
+					err = 4;
+				advance(all_len * elem_size);
+				break;
+			}
+			default:
+				std::cerr << "Unknown head type: " << (int)type << " pos: " << pos << std::endl;
+				err = 2;
+				break;
+			}
+
+			if (err != 0) {
+				pos = start;
+				return false;
+			}
+			return true;
+		}
+
+		// skip the sub-expressions of the current token,
+		// so the next token is its next sibling
+		bool skip() {
+			size_t remaining = token.num_subexprs();
+			while (remaining > 0) {
+				if (!next())
+					return false;
+				remaining += token.num_subexprs() - 1;
+			}
+			return true;
+		}
+
+		// is the whole buffer consumed
+		bool at_end() const { return pos >= size; }
+
+		WXF_HEAD type() const { return token.type; }
+		int64_t as_integer() const { return token.get_integer(); }
+		double as_real() const { return token.get_real(); }
+		std::string_view as_string_view() const { return token.get_string_view(); }
+		template<typename T>
+		std::span<const T> array_span() const { return token.get_arr_span<T>(); }
+	};
+
+	struct Parser : Cursor {
+		std::vector<Token> tokens;
+
+		// tape mode: record Token::tape for every function, association and rule,
+		// so a whole sub-expression can be skipped in O(1), see next_index
+		bool tape = false;
+		struct tape_frame {
+			size_t index; // the index of the open token
+			size_t remaining; // the number of sub-expressions not finished yet
+		};
+		std::vector<tape_frame> tape_stack;
+
+		// keeps the buffer alive if the parser owns it, e.g. a MappedFile
+		std::shared_ptr<const void> source;
+
+		using Cursor::Cursor;
+
+		// parse a mapped file, the parser shares the ownership of the mapping
+		explicit Parser(std::shared_ptr<const MappedFile> file) : Cursor(file->data, file->size) {
+			if (file->err != 0)
+				err = 1;
+			source = std::move(file);
+		}
+
+		// default special member functions
+		Parser() = default;
+		~Parser() = default;
+		Parser(const Parser&) = default;
+		Parser& operator=(const Parser&) = default;
+		Parser(Parser&&) noexcept = default;
+		Parser& operator=(Parser&&) noexcept = default;
+
+		// reuse the parser for a new buffer, the capacity of tokens is kept
+		void reset(const uint8_t* buf, const size_t len) {
+			Cursor::reset(buf, len);
+			source.reset();
+			tokens.clear();
+			tape_stack.clear();
+		}
+
+		// the index of the token after the sub-expression starting at tokens[i],
+		// O(1) for tokens parsed in tape mode, otherwise the sub-expression is counted
+		size_t next_index(size_t i) const {
+			auto n = tokens[i].num_subexprs();
+			if (n == 0)
+				return i + 1;
+			if (tokens[i].tape.next != 0)
+				return tokens[i].tape.next;
+
+			size_t remaining = n;
+			for (i++; remaining > 0 && i < tokens.size(); i++)
+				remaining += tokens[i].num_subexprs() - 1;
+			return i;
+		}
+
+		// update the tape after a new token is pushed
+		void push_tape() {
+			size_t index = tokens.size() - 1;
+			auto n = tokens[index].num_subexprs();
+			if (n > 0) {
+				tokens[index].tape = { 0, 0 };
+				tape_stack.push_back({ index, n });
+				return;
+			}
+
+			// a sub-expression is finished, close all finished parents
+			while (!tape_stack.empty()) {
+				auto& top = tape_stack.back();
+				if (--top.remaining > 0)
+					break;
+				tokens[top.index].tape = { tokens.size(), pos };
+				tape_stack.pop_back();
+			}
+		}
+
+		// replace a compressed buffer by its uncompressed content, the parser owns the new
+		// buffer and the old source (e.g. a MappedFile) is released
+		bool inflate_buffer() {
+#ifdef WXF_PARSER_USE_ZLIB
+			auto out = std::make_shared<std::vector<uint8_t>>();
+			Inflater inflater;
+			if (!inflater.inflate_wxf(buffer, size, *out)) {
+				std::cerr << "Invalid compressed WXF data" << std::endl;
+				err = 1;
+				return false;
+			}
+			buffer = out->data();
+			size = out->size();
+			pos = 0;
+			source = std::move(out);
+			return true;
+#else
+			std::cerr << "Compressed WXF is not supported, define WXF_PARSER_USE_ZLIB and link zlib" << std::endl;
+			err = 1;
+			return false;
+#endif
+		}
+
+		// read all tokens of the buffer
+		void parse() {
+			if (pos == 0 && check_head && is_compressed_wxf(buffer, size) && !inflate_buffer())
+				return;
+			while (next()) {
+				tokens.push_back(token);
+				if (tape)
+					push_tape();
 			}
+		}
+	};
+
+	// an incremental parser for input arriving in chunks (pipes, sockets, partial reads).
+	// feed() calls on_token(const Token&) for every token as soon as it is complete,
+	// a token split between chunks is kept in `pending` until the rest arrives.
+	// the data of a token is only valid during the call of on_token.
+	// compressed input ("8C:") is inflated chunk by chunk if WXF_PARSER_USE_ZLIB is defined
+	struct StreamParser {
+		std::vector<uint8_t> pending; // the bytes of an incomplete token
+		bool head_done = false; // the WXF head "8:" or "8C:" is read
+		bool compressed = false; // the input is compressed WXF
+		size_t remaining = 1; // the number of sub-expressions not finished yet
+		size_t consumed = 0; // the total number of bytes consumed, as uncompressed WXF
+		int err = 0; // the same as Cursor::err, but 3 (incomplete) is not an error here
+#ifdef WXF_PARSER_USE_ZLIB
+		Inflater inflater;
+#endif
+
+		StreamParser() = default;
+
+		// start a new message, the bytes fed after the end of the previous one are kept
+		void reset() {
+			head_done = false;
+			compressed = false;
+			remaining = 1;
+			consumed = 0;
 			err = 0;
+#ifdef WXF_PARSER_USE_ZLIB
+			inflater.reset();
+#endif
+		}
+
+		// the whole expression is read
+		bool done() const {
+#ifdef WXF_PARSER_USE_ZLIB
+			// the checksum of the zlib stream follows the last token
+			if (compressed && !inflater.finished)
+				return false;
+#endif
+			return head_done && remaining == 0;
+		}
+		// more input is needed to finish the expression
+		bool need_more() const { return err == 0 && !done(); }
+
+		// return true if more input is needed
+		template<typename F>
+		bool feed(const std::span<const uint8_t> chunk, F&& on_token) {
+			if (err != 0)
+				return false;
+			if (head_done)
+				return feed_body(chunk, on_token);
+
+			// the head may be split between chunks
+			std::vector<uint8_t> data;
+			std::span<const uint8_t> input = chunk;
+			if (!pending.empty()) {
+				pending.insert(pending.end(), chunk.begin(), chunk.end());
+				data.swap(pending);
+				input = data;
+			}
+
+			auto head = wxf_head_length(input.data(), input.size());
+			if (head < 0) {
+				std::cerr << "Invalid WXF file" << std::endl;
+				err = 1;
+				return false;
+			}
+			if (head == 0) {
+				pending.assign(input.begin(), input.end());
+				return true;
+			}
+
+			head_done = true;
+			compressed = (head == 3);
+			consumed += 2; // counted as the uncompressed head "8:"
+			return feed_body(input.subspan(head), on_token);
+		}
+
+		template<typename F>
+		bool feed(const std::vector<uint8_t>& chunk, F&& on_token) {
+			return feed(std::span<const uint8_t>(chunk), std::forward<F>(on_token));
+		}
+
+		// the bytes after the head
+		template<typename F>
+		bool feed_body(const std::span<const uint8_t> chunk, F& on_token) {
+			if (!compressed)
+				return feed_uncompressed(chunk, on_token);
+
+#ifdef WXF_PARSER_USE_ZLIB
+			if (inflater.finished) {
+				// fed after the end of the message, before reset()
+				pending.insert(pending.end(), chunk.begin(), chunk.end());
+				return need_more();
+			}
+			bool ok = inflater.inflate(chunk, [&](const std::span<const uint8_t> out) {
+				feed_uncompressed(out, on_token);
+				});
+			if (!ok && err == 0) {
+				std::cerr << "Invalid compressed WXF data" << std::endl;
+				err = 1;
+			}
+			if (inflater.finished && err == 0) {
+				if (remaining > 0) {
+					std::cerr << "Invalid compressed WXF data" << std::endl;
+					err = 1;
+					return false;
+				}
+				// the bytes after the zlib stream are the next message, they are kept raw in pending
+				// so that reset() starts with its head
+				pending.assign(chunk.begin() + inflater.used, chunk.end());
+			}
+#else
+			std::cerr << "Compressed WXF is not supported, define WXF_PARSER_USE_ZLIB and link zlib" << std::endl;
+			err = 1;
+#endif
+			return need_more();
+		}
+
+		template<typename F>
+		bool feed_uncompressed(const std::span<const uint8_t> chunk, F& on_token) {
+			if (err != 0)
+				return false;
+
+			// parse from the chunk directly if nothing is pending
+			const uint8_t* data = chunk.data();
+			size_t len = chunk.size();
+			if (!pending.empty()) {
+				pending.insert(pending.end(), chunk.begin(), chunk.end());
+				data = pending.data();
+				len = pending.size();
+			}
+
+			Cursor cursor(data, len);
+			cursor.check_head = false;
+			while (remaining > 0 && cursor.next()) {
+				remaining += cursor.token.num_subexprs() - 1;
+				on_token(cursor.token);
+			}
+			if (cursor.err != 0 && cursor.err != 3) {
+				err = cursor.err;
+				return false;
+			}
+
+			// keep the bytes not consumed
+			auto used = cursor.pos;
+			consumed += used;
+			if (pending.empty())
+				pending.assign(data + used, data + len);
+			else
+				pending.erase(pending.begin(), pending.begin() + used);
+
+			return need_more();
 		}
 	};
 
 	struct expr_node {
+		// the children are allocated from a memory resource, e.g. an Arena
+		using allocator_type = std::pmr::polymorphic_allocator<expr_node>;
+
 		size_t index; // the index of the token in the tokens vector
-		std::vector<expr_node> children;
+		std::pmr::vector<expr_node> children;
 		WXF_HEAD type;
 
 		expr_node() : index(0), children(), type(WXF_HEAD::i8) {} // default constructor
+		explicit expr_node(const allocator_type& alloc) : index(0), children(alloc), type(WXF_HEAD::i8) {}
 		~expr_node() = default;
 
 		expr_node(const expr_node&) = default; // copy constructor
@@ -715,7 +2404,13 @@ namespace WXF_PARSER {
 		expr_node(expr_node&& other) = default; // move constructor
 		expr_node& operator=(expr_node&& other) = default; // move assignment operator
 
-		expr_node(size_t idx, size_t sz, WXF_HEAD t) : index(idx), type(t) {
+		// allocator-extended constructors
+		expr_node(const expr_node& other, const allocator_type& alloc)
+			: index(other.index), children(other.children, alloc), type(other.type) {}
+		expr_node(expr_node&& other, const allocator_type& alloc)
+			: index(other.index), children(std::move(other.children), alloc), type(other.type) {}
+
+		expr_node(size_t idx, size_t sz, WXF_HEAD t, const allocator_type& alloc = {}) : index(idx), children(alloc), type(t) {
 			if (sz > 0) 
 				children.resize(sz);
 		}
@@ -729,10 +2424,12 @@ namespace WXF_PARSER {
 	struct expr_tree {
 		std::vector<Token> tokens;
 		expr_node root;
+		std::shared_ptr<const void> source; // the owner of the buffer, if any
 
 		expr_tree() {} // default constructor
 		expr_tree(Parser parser, size_t index, size_t size, WXF_HEAD type) : root(index, size, type) {
 			tokens = std::move(parser.tokens);
+			source = std::move(parser.source);
 		}
 
 		expr_tree(const expr_tree&) = default; //  copy constructor
@@ -763,28 +2460,41 @@ namespace WXF_PARSER {
 		}
 	};
 
-	inline expr_tree make_expr_tree(Parser& parser) {
-		expr_tree tree;
-		if (parser.err != 0)
-			return tree;
-
-		tree.tokens = std::move(parser.tokens);
+	// build the tree in place, the tokens of the parser are swapped into the tree
+	// and all nodes are allocated from the given memory resource
+	inline void make_expr_tree(expr_tree& tree, Parser& parser,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+		expr_node::allocator_type alloc(resource);
+
+		// the root must use the same resource as its children
+		std::destroy_at(&tree.root);
+		std::construct_at(&tree.root, alloc);
+
+		tree.tokens.swap(parser.tokens);
+		parser.tokens.clear();
+		tree.source = parser.source;
+		if (parser.err != 0) {
+			tree.tokens.clear();
+			return;
+		}
 
 		auto total_len = tree.tokens.size();
 		auto& tokens = tree.tokens;
-
-		std::vector<expr_node*> expr_stack; // the stack to store the current father nodes
-		std::vector<size_t> node_stack; // the vector to store the node index
-
-		std::function<void(void)> move_to_next_node = [&]() {
-			if (node_stack.empty())
-				return;
-
-			node_stack.back()++; // move to the next node
-			if (node_stack.back() >= expr_stack.back()->size()) {
+		if (total_len == 0)
+			return;
+
+		// the stack to store the current father nodes
+		std::pmr::vector<expr_node*> expr_stack(resource);
+		// the vector to store the node index
+		std::pmr::vector<size_t> node_stack(resource);
+
+		auto move_to_next_node = [&]() {
+			while (!node_stack.empty()) {
+				node_stack.back()++; // move to the next node
+				if (node_stack.back() < expr_stack.back()->size())
+					break;
 				expr_stack.pop_back(); // pop the current node
 				node_stack.pop_back(); // pop the current node index
-				move_to_next_node();
 			}
 			};
 
@@ -793,64 +2503,70 @@ namespace WXF_PARSER {
 		auto& token = tokens[pos];
 		if (token.type == WXF_HEAD::func) {
 			// i + 1 is the head of the function (a symbol)
-			tree.root = expr_node(pos + 1, token.length, token.type);
+			tree.root = expr_node(pos + 1, token.length, token.type, alloc);
 			pos += 2; // skip the head
 		}
 		else if (token.type == WXF_HEAD::association) {
 			// association does not have a head
-			tree.root = expr_node(pos + 1, token.length, token.type);
+			tree.root = expr_node(pos + 1, token.length, token.type, alloc);
 			pos += 1;
 		}
 		else {
 			// if the token is not a function type, only one token is allowed
-			tree.root = expr_node(pos, 0, token.type);
-			return tree;
+			tree.root = expr_node(pos, 0, token.type, alloc);
+			return;
 		}
 
+		if (tree.root.size() == 0)
+			return;
+
 		expr_stack.push_back(&(tree.root));
 		node_stack.push_back(0);
 
 		// now we need to parse the expression
 		for (; pos < total_len; pos++) {
 			auto& token = tokens[pos];
+			auto node_pos = node_stack.back();
+			auto parent = expr_stack.back();
+			auto& node = parent->children[node_pos];
 			if (token.type == WXF_HEAD::func || token.type == WXF_HEAD::association) {
 				// if the token is a function type, we need to create a new node
-				auto node_pos = node_stack.back();
-				auto parent = expr_stack.back();
-				auto& node = parent->children[node_pos];
 				if (token.type == WXF_HEAD::func) {
-					node = expr_node(pos + 1, token.length, token.type);
+					node = expr_node(pos + 1, token.length, token.type, alloc);
 					pos++; // skip the head
 				}
 				else
-					node = expr_node(pos, token.length, token.type);
-				expr_stack.push_back(&(node)); // push the new node to the stack
-				node_stack.push_back(0); // push the new node index to the stack
+					node = expr_node(pos, token.length, token.type, alloc);
 			}
 			else if (token.type == WXF_HEAD::delay_rule || token.type == WXF_HEAD::rule) {
 				// if the token is a rule type, we need to create a new node
-				auto node_pos = node_stack.back();
-				auto parent = expr_stack.back();
-				auto& node = parent->children[node_pos];
-				node = expr_node(pos, 2, token.type);
-				expr_stack.push_back(&(node)); // push the new node to the stack
-				node_stack.push_back(0); // push the new node index to the stack
+				node = expr_node(pos, 2, token.type, alloc);
 			}
 			else {
 				// if the token is not a function type, we need to move to the next node
-				auto node_pos = node_stack.back();
-				auto parent = expr_stack.back();
-				auto& node = parent->children[node_pos];
-				node = expr_node(pos, 0, token.type);
+				node = expr_node(pos, 0, token.type, alloc);
+			}
 
+			if (node.size() > 0) {
+				expr_stack.push_back(&(node)); // push the new node to the stack
+				node_stack.push_back(0); // push the new node index to the stack
+			}
+			else {
 				move_to_next_node();
 			}
+
+			if (node_stack.empty())
+				break;
 		}
 
 		if (!node_stack.empty()) {
 			std::cerr << "Error: not all nodes are parsed" << std::endl;
 		}
+	}
 
+	inline expr_tree make_expr_tree(Parser& parser) {
+		expr_tree tree;
+		make_expr_tree(tree, parser);
 		return tree;
 	}
 
@@ -872,62 +2588,312 @@ namespace WXF_PARSER {
 		return make_expr_tree(parser);
 	}
 
-} // namespace WXF_PARSER
-
-/***********************************************************************************/
+	// a node of flat_expr_tree, the children of a node are stored contiguously
+	// in flat_expr_tree::nodes, starting from first
+	struct flat_expr_node {
+		size_t index; // the index of the token in the tokens vector
+		size_t first; // the position of the first child in the nodes vector
+		size_t count; // the number of children
+		WXF_HEAD type;
 
-// a simple FullForm parser, we only support [0-9,a-z,A-Z,$] in symbol names
-// it is used to write a template engine to generate WXF files
-// and we add a special expression type starting with # for subexpression labels
-// e.g. #x for a integer x, e.g. #1, #2, ...
-// and then we can replace these labels with actual expressions when generating WXF files
+		size_t size() const { return count; }
+		bool has_children() const { return count > 0; }
+	};
 
-// !! do not use for high percision numbers or very large integers, it only supports standard C++ number formats
-// !! it is not efficient and robust enough now, make your template simple
-// !! and handle complicated sub-expressions manually by using push_** in Encoder
+	// the same structure as expr_tree, but all nodes live in one vector, so building
+	// it costs one allocation and destroying it does not recurse
+	struct flat_expr_tree {
+		std::vector<Token> tokens;
+		std::vector<flat_expr_node> nodes; // nodes[0] is the root
+		std::shared_ptr<const void> source; // the owner of the buffer, if any
 
-namespace WXF_PARSER::FullForm {
-	enum class atom_type {
-		Integer,
-		Real,
-		String,
-		Symbol,
-		Expression,
-		Null
-	};
+		const flat_expr_node& root() const { return nodes[0]; }
+		bool empty() const { return nodes.empty(); }
 
-	struct atom_expression {
-		atom_type type_;
-		std::string value_;
+		const Token& operator[](const flat_expr_node& node) const {
+			return tokens[node.index];
+		}
 
-		atom_expression(atom_type type, const std::string_view value)
-			: type_(type), value_(value) {
+		std::span<const flat_expr_node> children(const flat_expr_node& node) const {
+			return std::span<const flat_expr_node>(nodes.data() + node.first, node.count);
 		}
 
-		const atom_type get_type() const { return type_; }
-		const std::string& get_value() const { return value_; }
+		const flat_expr_node& child(const flat_expr_node& node, size_t i) const {
+			return nodes[node.first + i];
+		}
 
-		std::string to_FullForm() const {
-			switch (type_) {
-			case atom_type::String:
-				return "\"" + value_ + "\"";
-			default:
-				return value_;
+		void print(std::ostream& ss, const flat_expr_node& node, const int level = 0) const {
+			for (int i = 0; i < level; i++)
+				ss << "  ";
+			ss << "Node type: " << (int)node.type << ", index: " << node.index << ", size: " << node.size() << std::endl;
+			for (auto& c : children(node)) {
+				print(ss, c, level + 1);
 			}
 		}
-	};
 
-	struct lexer {
-		std::string input_;
-		size_t position_;
-		size_t length_;
+		void print(std::ostream& ss) const {
+			if (!empty())
+				print(ss, root(), 0);
+		}
 
-		char current_char() const {
-			return position_ < length_ ? input_[position_] : '\0';
+		void print() const {
+			print(std::cout);
 		}
+	};
 
-		void advance() {
-			if (position_ < length_) position_++;
+	// the tree owns the mapping, so all string and array tokens stay views into the file
+	inline expr_tree make_expr_tree_from_file(const std::filesystem::path& path, const int advice = map_sequential) {
+		Parser parser(std::make_shared<const MappedFile>(path, advice));
+		parser.parse();
+		return make_expr_tree(parser);
+	}
+
+	// build the flat tree in one pass, the tokens of the parser are swapped into the tree
+	// and the capacity of tree.nodes is reused
+	inline void make_flat_expr_tree(flat_expr_tree& tree, Parser& parser,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+		tree.nodes.clear();
+		tree.tokens.swap(parser.tokens);
+		parser.tokens.clear();
+		tree.source = parser.source;
+		if (parser.err != 0) {
+			tree.tokens.clear();
+			return;
+		}
+
+		auto& tokens = tree.tokens;
+		auto total_len = tokens.size();
+		if (total_len == 0)
+			return;
+
+		// there are at most as many nodes as tokens
+		tree.nodes.resize(total_len);
+		auto nodes = tree.nodes.data();
+		size_t used = 1; // nodes[0] is the root
+
+		// the children to be filled: [next, end) in nodes
+		struct frame {
+			size_t next;
+			size_t end;
+		};
+		std::pmr::vector<frame> stack(resource);
+
+		// the counts in a malformed or truncated input may claim more nodes than there are tokens
+		bool overflow = false;
+
+		// set the node at slot, and return the number of its children
+		auto set_node = [&](size_t slot, size_t& pos) {
+			auto& token = tokens[pos];
+			size_t count = 0;
+			auto& node = nodes[slot];
+			node.type = token.type;
+			node.index = pos;
+			if (token.type == WXF_HEAD::func) {
+				// pos + 1 is the head of the function (a symbol)
+				node.index = pos + 1;
+				count = token.length;
+				pos++;
+			}
+			else if (token.type == WXF_HEAD::association) {
+				count = token.length;
+			}
+			else if (token.type == WXF_HEAD::delay_rule || token.type == WXF_HEAD::rule) {
+				count = 2;
+			}
+			if (pos >= total_len || count > total_len - used) {
+				overflow = true;
+				node.count = 0;
+				return size_t(0);
+			}
+			node.first = used;
+			node.count = count;
+			used += count;
+			return count;
+			};
+
+		size_t pos = 0;
+		set_node(0, pos);
+		if (nodes[0].type == WXF_HEAD::delay_rule || nodes[0].type == WXF_HEAD::rule) {
+			// same as expr_tree, a rule at the top level is taken as an atom
+			nodes[0].count = 0;
+			used = 1;
+		}
+		else if (nodes[0].count > 0) {
+			stack.push_back({ nodes[0].first, nodes[0].first + nodes[0].count });
+
+			for (pos++; pos < total_len && !stack.empty() && !overflow; pos++) {
+				auto slot = stack.back().next++;
+				if (set_node(slot, pos) > 0)
+					stack.push_back({ nodes[slot].first, nodes[slot].first + nodes[slot].count });
+
+				while (!stack.empty() && stack.back().next == stack.back().end)
+					stack.pop_back();
+			}
+		}
+
+		if (overflow) {
+			std::cerr << "Error: the argument counts do not match the tokens" << std::endl;
+			tree.nodes.clear();
+			tree.tokens.clear();
+			return;
+		}
+		if (!stack.empty()) {
+			std::cerr << "Error: not all nodes are parsed" << std::endl;
+		}
+		tree.nodes.resize(used);
+	}
+
+	inline flat_expr_tree make_flat_expr_tree(Parser& parser) {
+		flat_expr_tree tree;
+		make_flat_expr_tree(tree, parser);
+		return tree;
+	}
+
+	inline flat_expr_tree make_flat_expr_tree(const uint8_t* str, const size_t len) {
+		Parser parser(str, len);
+		parser.parse();
+		return make_flat_expr_tree(parser);
+	}
+
+	inline flat_expr_tree make_flat_expr_tree(const std::vector<uint8_t>& str) {
+		Parser parser(str);
+		parser.parse();
+		return make_flat_expr_tree(parser);
+	}
+
+	inline flat_expr_tree make_flat_expr_tree(const std::string_view str) {
+		Parser parser(str);
+		parser.parse();
+		return make_flat_expr_tree(parser);
+	}
+
+	inline flat_expr_tree make_flat_expr_tree_from_file(const std::filesystem::path& path, const int advice = map_sequential) {
+		Parser parser(std::make_shared<const MappedFile>(path, advice));
+		parser.parse();
+		return make_flat_expr_tree(parser);
+	}
+
+	// decode many messages with the same memory: the tokens, the nodes and the stacks
+	// are all reused, so there is no heap allocation after warm-up.
+	// the tree returned by decode is valid until the next decode/reset
+	struct DecodeContext {
+		Arena arena;
+		Parser parser;
+		expr_tree tree;
+		flat_expr_tree flat_tree;
+
+		DecodeContext() = default;
+		DecodeContext(const size_t initial_size) : arena(initial_size) {}
+		DecodeContext(const DecodeContext&) = delete;
+		DecodeContext& operator=(const DecodeContext&) = delete;
+
+		void reset() {
+			// the nodes are released to the arena (no-op) before it rewinds
+			std::destroy_at(&tree.root);
+			std::construct_at(&tree.root);
+			tree.source.reset();
+			flat_tree.source.reset();
+			if (tree.tokens.capacity() > parser.tokens.capacity())
+				parser.tokens.swap(tree.tokens);
+			if (flat_tree.tokens.capacity() > parser.tokens.capacity())
+				parser.tokens.swap(flat_tree.tokens);
+			parser.tokens.clear();
+			arena.reset();
+		}
+
+		const expr_tree& decode(const uint8_t* str, const size_t len) {
+			reset();
+			parser.reset(str, len);
+			parser.parse();
+			make_expr_tree(tree, parser, &arena);
+			return tree;
+		}
+
+		const expr_tree& decode(const std::vector<uint8_t>& str) { return decode(str.data(), str.size()); }
+		const expr_tree& decode(const std::string_view str) { return decode((const uint8_t*)str.data(), str.size()); }
+
+		const flat_expr_tree& decode_flat(const uint8_t* str, const size_t len) {
+			reset();
+			parser.reset(str, len);
+			parser.parse();
+			make_flat_expr_tree(flat_tree, parser, &arena);
+			return flat_tree;
+		}
+
+		const flat_expr_tree& decode_flat(const std::vector<uint8_t>& str) { return decode_flat(str.data(), str.size()); }
+		const flat_expr_tree& decode_flat(const std::string_view str) { return decode_flat((const uint8_t*)str.data(), str.size()); }
+	};
+
+	// a place in a compiled FullForm template (see CompiledTemplate) where the bytes are not constant
+	struct template_hole {
+		enum kind_type : uint8_t {
+			value,    // #name, one expression
+			sequence, // #name..., any number of arguments of the enclosing function
+			count     // the argument count of a function with sequences
+		};
+		size_t offset = 0; // where it goes in the constant bytes
+		size_t slot = 0;   // value and sequence: the placeholder is names[slot]
+		kind_type kind = value;
+		size_t base = 0;   // count: the arguments besides the sequences, sequence: the index of its count hole
+	};
+
+} // namespace WXF_PARSER
+
+/***********************************************************************************/
+
+// a simple FullForm parser, we only support [0-9,a-z,A-Z,$] in symbol names
+// it is used to write a template engine to generate WXF files
+// and we add a special expression type starting with # for subexpression labels
+// e.g. #x for a integer x, e.g. #1, #2, ...
+// and then we can replace these labels with actual expressions when generating WXF files
+// #x... marks a sequence of arguments, it is supported by CompiledTemplate and static_template
+
+// !! do not use for high percision numbers or very large integers, it only supports standard C++ number formats
+// !! it is not efficient and robust enough now, make your template simple
+// !! and handle complicated sub-expressions manually by using push_** in Encoder
+
+namespace WXF_PARSER::FullForm {
+	enum class atom_type {
+		Integer,
+		Real,
+		String,
+		Symbol,
+		Expression,
+		Null
+	};
+
+	struct atom_expression {
+		atom_type type_;
+		std::string value_;
+
+		atom_expression(atom_type type, const std::string_view value)
+			: type_(type), value_(value) {
+		}
+
+		const atom_type get_type() const { return type_; }
+		const std::string& get_value() const { return value_; }
+
+		std::string to_FullForm() const {
+			switch (type_) {
+			case atom_type::String:
+				return "\"" + value_ + "\"";
+			default:
+				return value_;
+			}
+		}
+	};
+
+	struct lexer {
+		std::string input_;
+		size_t position_;
+		size_t length_;
+
+		char current_char() const {
+			return position_ < length_ ? input_[position_] : '\0';
+		}
+
+		void advance() {
+			if (position_ < length_) position_++;
 		}
 
 		void skip_ws() {
@@ -989,6 +2955,11 @@ namespace WXF_PARSER::FullForm {
 					value += current_char();
 					advance();
 				}
+				// #xxx... is a sequence of arguments
+				if (input_.compare(position_, 3, "...") == 0) {
+					value += "...";
+					position_ += 3;
+				}
 				return { EXPRESSION, value, startPos };
 			}
 
@@ -1102,216 +3073,1302 @@ namespace WXF_PARSER::FullForm {
 				return { COMMA, ",", startPos };
 			}
 
-			std::cerr << "Unknown character '" << ch << "' at position " << position_ << std::endl;
-			return { END, "", position_ };
+			std::cerr << "Unknown character '" << ch << "' at position " << position_ << std::endl;
+			return { END, "", position_ };
+		}
+	};
+
+	struct expression {
+		atom_expression head_;
+		std::vector<expression> args_;
+
+		expression(const atom_expression& head) : head_(head), args_() {}
+		expression(const atom_expression& head, const std::vector<expression>& args) : head_(head), args_(args) {}
+		bool is_atom() const { return args_.size() == 0; }
+
+		std::string to_FullForm() const {
+			if (is_atom()) {
+				return head_.to_FullForm();
+			}
+			else {
+				std::string result = head_.to_FullForm() + "[";
+				for (size_t i = 0; i < args_.size(); ++i) {
+					result += args_[i].to_FullForm();
+					if (i + 1 < args_.size()) {
+						result += ", ";
+					}
+				}
+				result += "]";
+				return result;
+			}
+		}
+	};
+
+	struct parser {
+		lexer lexer_;
+		lexer::token currentToken_;
+
+		void consume(lexer::token_type expected) {
+			if (currentToken_.type == expected) {
+				currentToken_ = lexer_.nextToken();
+			}
+			else {
+				std::cerr << "Parse Error: Unexpected token '" << currentToken_.value
+					<< "', expected " << static_cast<int>(expected)
+					<< " at position " << currentToken_.position << std::endl;
+			}
+		}
+
+		atom_expression parse_atom() {
+			std::string value = currentToken_.value;
+
+			switch (currentToken_.type) {
+			case lexer::IDENTIFIER: {
+				consume(lexer::IDENTIFIER);
+				return atom_expression(atom_type::Symbol, value);
+			}
+			case lexer::EXPRESSION: {
+				consume(lexer::EXPRESSION);
+				return atom_expression(atom_type::Expression, value);
+			}
+			case lexer::INTEGER: {
+				consume(lexer::INTEGER);
+				return atom_expression(atom_type::Integer, value);
+			}
+			case lexer::REAL: {
+				consume(lexer::REAL);
+				return atom_expression(atom_type::Real, value);
+			}
+			case lexer::STRING: {
+				consume(lexer::STRING);
+				return atom_expression(atom_type::String, value);
+			}
+			default:
+				std::cerr << "Parse Error: Unexpected token '" << currentToken_.value
+					<< "' at position " << currentToken_.position << std::endl;
+				return atom_expression(atom_type::Null, "");
+			}
+		}
+
+		expression parse_expression() {
+			atom_expression head = parse_atom();
+
+			if (currentToken_.type == lexer::LBRACKET) {
+				consume(lexer::LBRACKET);
+				std::vector<expression> args;
+
+				if (currentToken_.type != lexer::RBRACKET) {
+					args.push_back(parse_expression());
+
+					while (currentToken_.type == lexer::COMMA) {
+						consume(lexer::COMMA);
+						args.push_back(parse_expression());
+					}
+				}
+
+				// if we meet expr like f[], we use a null atom as argument
+				if (args.size() == 0) {
+					args.push_back(expression(atom_expression(atom_type::Null, "")));
+				}
+
+				consume(lexer::RBRACKET);
+				return expression(head, args);
+			}
+
+			return head;
+		}
+
+		parser(const std::string_view input) : lexer_(input) {
+			currentToken_ = lexer_.nextToken();
+		}
+
+		expression parse() {
+			expression result = parse_expression();
+
+			if (currentToken_.type != lexer::END) {
+				std::cerr << "Parse Error: Unexpected token at end: " << currentToken_.value << std::endl;
+			}
+
+			return result;
+		}
+	};
+
+	// we allow use { }, so we need to convert { } to List[ ], but not inside strings
+	inline expression parse_FullForm(const std::string_view str) {
+		std::string mod_str;
+		mod_str.reserve(str.size() + 10);
+		bool in_string = false;
+		for (size_t i = 0; i < str.size(); i++) {
+			char c = str[i];
+			if (in_string) {
+				mod_str += c;
+				if (c == '\\' && i + 1 < str.size())
+					mod_str += str[++i]; // an escaped quote does not end the string
+				else if (c == '"')
+					in_string = false;
+			}
+			else if (c == '"') {
+				mod_str += c;
+				in_string = true;
+			}
+			else if (c == '{')
+				mod_str += "List[";
+			else if (c == '}')
+				mod_str += "]";
+			else
+				mod_str += c;
+		}
+
+		parser parser(mod_str);
+		return parser.parse();
+	}
+
+	// a string literal as a template argument
+	template<size_t N>
+	struct fixed_string {
+		char data[N] = {};
+
+		consteval fixed_string(const char(&str)[N]) {
+			for (size_t i = 0; i < N; i++)
+				data[i] = str[i];
+		}
+
+		constexpr std::string_view view() const { return std::string_view(data, N - 1); }
+	};
+
+	// the grammar of lexer and parser evaluated at compile time, it gives the WXF bytes (without the head)
+	// and the placeholders like encode_fullform. errors throw, which fails the compilation.
+	// reals must be exact by the fast path of Clinger (at most 2^53 as mantissa, |exponent| <= 22),
+	// and { } are replaced by List[ ] only outside strings
+	struct static_compiler {
+		enum token_type { IDENTIFIER, EXPRESSION, INTEGER, REAL, STRING, LBRACKET, RBRACKET, COMMA, LIST, END };
+
+		struct token {
+			token_type type;
+			std::string_view value; // for STRING, the raw text between the quotes
+		};
+
+		std::string_view input;
+		size_t position = 0;
+		std::vector<uint8_t> bytes;
+		std::vector<template_hole> holes; // the slots are set by compile_fullform
+		std::vector<std::string_view> hole_names; // empty for count holes
+
+		constexpr static_compiler(const std::string_view str) : input(str) {}
+
+		static constexpr bool is_space(const char c) {
+			return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+		}
+		static constexpr bool is_digit(const char c) { return c >= '0' && c <= '9'; }
+		static constexpr bool is_alpha(const char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+		static constexpr bool is_name_char(const char c) { return is_alpha(c) || is_digit(c) || c == '$'; }
+
+		constexpr char current_char() const { return position < input.size() ? input[position] : '\0'; }
+
+		constexpr token next_token() {
+			while (position < input.size() && is_space(input[position]))
+				position++;
+			if (position >= input.size())
+				return { END, {} };
+
+			size_t start = position;
+			char ch = input[position];
+
+			if (is_alpha(ch) || ch == '$' || ch == '#') {
+				position++;
+				while (position < input.size() && is_name_char(input[position]))
+					position++;
+				if (ch == '#' && input.substr(position, 3) == "...")
+					position += 3;
+				return { ch == '#' ? EXPRESSION : IDENTIFIER, input.substr(start, position - start) };
+			}
+
+			if (is_digit(ch) || ch == '.' || ch == '-') {
+				if (ch == '-') {
+					position++;
+					if (!is_digit(current_char()))
+						return { IDENTIFIER, input.substr(start, 1) };
+				}
+				bool is_real = false;
+				while (is_digit(current_char()))
+					position++;
+				if (current_char() == '.') {
+					is_real = true;
+					position++;
+					while (is_digit(current_char()))
+						position++;
+				}
+				if (current_char() == 'e' || current_char() == 'E') {
+					is_real = true;
+					position++;
+					if (current_char() == '+' || current_char() == '-')
+						position++;
+					if (!is_digit(current_char()))
+						throw "FullForm: invalid scientific notation";
+					while (is_digit(current_char()))
+						position++;
+				}
+				return { is_real ? REAL : INTEGER, input.substr(start, position - start) };
+			}
+
+			if (ch == '"') {
+				position++;
+				while (position < input.size() && input[position] != '"')
+					position += (input[position] == '\\' && position + 1 < input.size()) ? 2 : 1;
+				if (position >= input.size())
+					throw "FullForm: unterminated string";
+				position++;
+				return { STRING, input.substr(start + 1, position - start - 2) };
+			}
+
+			position++;
+			switch (ch) {
+			case '[': return { LBRACKET, {} };
+			case ']': case '}': return { RBRACKET, {} };
+			case ',': return { COMMA, {} };
+			case '{': return { LIST, {} };
+			default: throw "FullForm: unknown character";
+			}
+		}
+
+		constexpr void put_varint(uint64_t val) {
+			do {
+				uint8_t byte = val & 0x7F;
+				val >>= 7;
+				if (val != 0) byte |= 0x80;
+				bytes.push_back(byte);
+			} while (val != 0);
+		}
+
+		constexpr void put_little_endian(const uint64_t val, const size_t len) {
+			for (size_t i = 0; i < len; i++)
+				bytes.push_back((uint8_t)(val >> (8 * i)));
+		}
+
+		// symbols and strings, with the escapes of lexer
+		constexpr void put_string(const WXF_HEAD type, const std::string_view str, const bool escaped) {
+			std::vector<uint8_t> value;
+			for (size_t i = 0; i < str.size(); i++) {
+				if (escaped && str[i] == '\\' && i + 1 < str.size()) {
+					char next = str[++i];
+					switch (next) {
+					case 'n': value.push_back('\n'); break;
+					case 't': value.push_back('\t'); break;
+					case 'r': value.push_back('\r'); break;
+					case '"': value.push_back('"'); break;
+					case '\\': value.push_back('\\'); break;
+					default: value.push_back('\\'); value.push_back((uint8_t)next); break;
+					}
+				}
+				else
+					value.push_back((uint8_t)str[i]);
+			}
+			bytes.push_back((uint8_t)type);
+			put_varint(value.size());
+			bytes.insert(bytes.end(), value.begin(), value.end());
+		}
+
+		constexpr void put_integer(const std::string_view str) {
+			bool negative = str[0] == '-';
+			uint64_t val = 0;
+			for (size_t i = negative ? 1 : 0; i < str.size(); i++) {
+				if (val > (UINT64_MAX - 9) / 10)
+					throw "FullForm: integer out of range";
+				val = val * 10 + (str[i] - '0');
+			}
+			if (val > (uint64_t)INT64_MAX + (negative ? 1 : 0))
+				throw "FullForm: integer out of range";
+			int64_t x = negative ? (int64_t)(0 - val) : (int64_t)val;
+			auto num_type = minimal_signed_bits(x);
+			bytes.push_back((uint8_t)(num_type == 0 ? WXF_HEAD::i8 : num_type == 1 ? WXF_HEAD::i16
+				: num_type == 2 ? WXF_HEAD::i32 : WXF_HEAD::i64));
+			put_little_endian((uint64_t)x, size_t(1) << num_type);
+		}
+
+		constexpr void put_real(const std::string_view str) {
+			constexpr uint64_t max_mantissa = uint64_t(1) << 53;
+			bool negative = str[0] == '-';
+			uint64_t mantissa = 0;
+			int64_t exponent = 0; // value = mantissa * 10^exponent
+			size_t zeros = 0;     // trailing zeros not yet in the mantissa
+			bool has_digit = false, fraction = false;
+			size_t i = negative ? 1 : 0;
+			for (; i < str.size() && str[i] != 'e' && str[i] != 'E'; i++) {
+				if (str[i] == '.') {
+					fraction = true;
+					continue;
+				}
+				has_digit = true;
+				if (fraction)
+					exponent--;
+				if (str[i] == '0') {
+					zeros++;
+					continue;
+				}
+				for (; zeros > 0; zeros--) {
+					if (mantissa > max_mantissa / 10)
+						throw "FullForm: the real is not exact at compile time";
+					mantissa *= 10;
+				}
+				if (mantissa > (max_mantissa - (str[i] - '0')) / 10)
+					throw "FullForm: the real is not exact at compile time";
+				mantissa = mantissa * 10 + (str[i] - '0');
+			}
+			if (!has_digit)
+				throw "FullForm: invalid real";
+			if (i < str.size()) {
+				bool negative_exp = str[++i] == '-';
+				if (str[i] == '+' || str[i] == '-')
+					i++;
+				int64_t exp = 0;
+				for (; i < str.size(); i++)
+					exp = std::min<int64_t>(exp * 10 + (str[i] - '0'), 100000);
+				exponent += negative_exp ? -exp : exp;
+			}
+			exponent += (int64_t)zeros;
+
+			double pow10[23] = {};
+			pow10[0] = 1.0;
+			for (int k = 1; k < 23; k++)
+				pow10[k] = pow10[k - 1] * 10.0;
+
+			double val = 0.0;
+			if (mantissa != 0) {
+				// move the exponent into the mantissa while it is exact
+				while (exponent > 22 && mantissa <= max_mantissa / 10) {
+					mantissa *= 10;
+					exponent--;
+				}
+				if (exponent > 22 || exponent < -22)
+					throw "FullForm: the real is not exact at compile time";
+				val = exponent >= 0 ? (double)mantissa * pow10[exponent] : (double)mantissa / pow10[-exponent];
+			}
+			bytes.push_back((uint8_t)WXF_HEAD::f64);
+			put_little_endian(std::bit_cast<uint64_t>(negative ? -val : val), 8);
+		}
+
+		constexpr void parse_expression(const bool is_argument = false) {
+			auto head = next_token();
+			if (head.type == COMMA || head.type == LBRACKET || head.type == RBRACKET || head.type == END)
+				throw "FullForm: unexpected token";
+
+			size_t saved = position;
+			if (head.type != LIST && next_token().type != LBRACKET) {
+				position = saved;
+				switch (head.type) {
+				case IDENTIFIER: put_string(WXF_HEAD::symbol, head.value, false); break;
+				case INTEGER: put_integer(head.value); break;
+				case REAL: put_real(head.value); break;
+				case STRING: put_string(WXF_HEAD::string, head.value, true); break;
+				default: {
+					template_hole h;
+					h.offset = bytes.size();
+					h.kind = head.value.ends_with("...") ? template_hole::sequence : template_hole::value;
+					if (h.kind == template_hole::sequence && !is_argument)
+						throw "FullForm: a sequence must be an argument of a function";
+					holes.push_back(h);
+					hole_names.push_back(head.value);
+					break;
+				}
+				}
+				return;
+			}
+
+			// a function, the argument count is inserted after the arguments
+			bytes.push_back((uint8_t)WXF_HEAD::func);
+			size_t count_pos = bytes.size();
+			size_t first_hole = holes.size();
+			if (head.type == LIST)
+				put_string(WXF_HEAD::symbol, "List", false);
+			else
+				put_string(WXF_HEAD::symbol, head.value, head.type == STRING);
+
+			size_t num_args = 0;
+			std::vector<size_t> sequences; // the holes of sequence arguments
+			saved = position;
+			if (next_token().type != RBRACKET) {
+				position = saved;
+				while (true) {
+					size_t num_holes = holes.size();
+					parse_expression(true);
+					if (holes.size() == num_holes + 1 && holes.back().kind == template_hole::sequence
+						&& holes.back().offset == bytes.size())
+						sequences.push_back(num_holes);
+					else
+						num_args++;
+					auto tok = next_token();
+					if (tok.type == RBRACKET)
+						break;
+					if (tok.type != COMMA)
+						throw "FullForm: expected , or ]";
+				}
+			}
+
+			if (!sequences.empty()) {
+				// the count is a hole before the holes of the arguments
+				for (auto& h : holes)
+					if (h.kind == template_hole::sequence && h.base >= first_hole)
+						h.base++;
+				for (auto i : sequences)
+					holes[i].base = first_hole;
+				template_hole h;
+				h.offset = count_pos;
+				h.kind = template_hole::count;
+				h.base = num_args;
+				holes.insert(holes.begin() + first_hole, h);
+				hole_names.insert(hole_names.begin() + first_hole, std::string_view());
+				return;
+			}
+
+			size_t end = bytes.size();
+			put_varint(num_args);
+			size_t len = bytes.size() - end;
+			std::rotate(bytes.begin() + count_pos, bytes.begin() + end, bytes.end());
+			for (auto& h : holes)
+				if (h.offset >= count_pos)
+					h.offset += len;
+		}
+
+		constexpr static_compiler& run() {
+			parse_expression();
+			if (next_token().type != END)
+				throw "FullForm: unexpected token at end";
+			return *this;
+		}
+	};
+} // namespace WXF_PARSER::FullForm
+
+namespace WXF_PARSER {
+	// walk the template with any encoder (Encoder, SizeCounter, ...),
+	// on_placeholder(encoder, name) is called for every #xxx
+	template<typename EncoderType, typename F>
+	void encode_fullform(EncoderType& encoder, const FullForm::expression& expr, F&& on_placeholder) {
+
+		if (expr.is_atom()) {
+			switch (expr.head_.get_type()) {
+			case FullForm::atom_type::Integer:
+				encoder.push_integer(std::stoll(expr.head_.get_value()));
+				break;
+			case FullForm::atom_type::Real:
+				encoder.push_real(std::stod(expr.head_.get_value()));
+				break;
+			case FullForm::atom_type::String:
+				encoder.push_string(expr.head_.get_value());
+				break;
+			case FullForm::atom_type::Symbol:
+				encoder.push_symbol(expr.head_.get_value());
+				break;
+			case FullForm::atom_type::Null:
+				break;
+			case FullForm::atom_type::Expression:
+				on_placeholder(encoder, expr.head_.get_value());
+				break;
+			default:
+				std::cerr << "Error: unknown atom type." << std::endl;
+				break;
+			}
+		}
+		else {
+			size_t len = expr.args_.size();
+			if (expr.args_[0].is_atom() &&
+				expr.args_[0].head_.get_type() == FullForm::atom_type::Null) {
+				len = 0;
+			}
+			std::string_view name = expr.head_.get_value();
+
+			// Rule or DelayRule is not special in FullForm, we treat them as normal functions
+			encoder.push_function(name, len);
+
+			for (size_t i = 0; i < len; i++) {
+				encode_fullform(encoder, expr.args_[i], on_placeholder);
+			}
+		}
+	}
+
+	// we allow use a map to store function that generating sub-expressions.
+	// a placeholder missing from the map is reported and sent as Null, the same for all the overloads
+	inline void fullform_to_wxf(Encoder& encoder, const FullForm::expression& expr,
+		const std::unordered_map<std::string, std::function<void(Encoder&)>>& map) {
+		encode_fullform(encoder, expr, [&](Encoder& enc, const std::string& vv) {
+			auto it = map.find(vv);
+			if (it != map.end()) {
+				it->second(enc);
+			}
+			else {
+				std::cerr << "Error: expression id " << vv << " not found in map." << std::endl;
+				enc.push_symbol(symbols::Null);
+			}
+			});
+	}
+
+	inline void fullform_to_wxf(Encoder& encoder, const FullForm::expression& expr,
+		const std::unordered_map<std::string, Encoder>& map) {
+		encode_fullform(encoder, expr, [&](Encoder& enc, const std::string& vv) {
+			auto it = map.find(vv);
+			if (it != map.end()) {
+				enc.push_ustr(it->second.buffer);
+			}
+			else {
+				std::cerr << "Error: expression id " << vv << " not found in map." << std::endl;
+				enc.push_symbol(symbols::Null);
+			}
+			});
+	}
+
+	// a value bound to a template placeholder by slot, pushed directly without an Encoder in between.
+	// it is an integer, a real, a string or symbol, an array (data and dimensions) or encoded bytes,
+	// strings, arrays and encoded bytes are only referenced, so they must outlive the instantiation
+	// (binding a temporary std::string, std::vector or Encoder does not compile)
+	struct template_arg {
+		// arrays up to this rank keep their dimensions inside
+		static constexpr int inline_rank = 4;
+
+		WXF_HEAD type = WXF_HEAD::symbol;
+		bool encoded = false; // data[0, length) is an encoded expression
+		bool sequence = false; // data points to length template_args, for #xxx...
+		uint8_t num_type = 0; // for array and narray only
+		int rank = 0;
+		// for string and symbol: the length in bytes, for array and narray: the payload in bytes
+		size_t length = 4;
+		const uint8_t* data = (const uint8_t*)"Null";
+
+		union {
+			int64_t integer = 0;
+			uint64_t big_integer; // an unsigned integer above INT64_MAX, sent as bigint
+			double real;
+			size_t dimensions[inline_rank];
+		};
+		std::shared_ptr<const size_t[]> more_dimensions; // for rank > inline_rank
+
+		// Null if nothing is bound
+		template_arg() = default;
+		~template_arg() = default;
+		template_arg(const template_arg&) = default;
+		template_arg& operator=(const template_arg&) = default;
+
+		template<typename T>
+			requires std::is_integral_v<T> && (!std::is_same_v<T, bool>)
+		template_arg(const T val) : type(WXF_HEAD::i64), length(0), data(nullptr), integer((int64_t)val) {
+			if constexpr (std::is_unsigned_v<T> && sizeof(T) >= sizeof(int64_t)) {
+				if (val > (uint64_t)INT64_MAX) {
+					type = WXF_HEAD::bigint;
+					big_integer = val;
+				}
+			}
+		}
+		// bool is not an integer in WXF, bind the symbol True or False instead
+		template_arg(const bool) = delete;
+		template_arg(const double val) : type(WXF_HEAD::f64), length(0), data(nullptr), real(val) {}
+		template_arg(const std::string_view str, const WXF_HEAD t = WXF_HEAD::string)
+			: type(t), length(str.size()), data((const uint8_t*)str.data()) {
+		}
+		template_arg(const char* str) : template_arg(std::string_view(str)) {}
+		template_arg(std::string&&, const WXF_HEAD = WXF_HEAD::string) = delete;
+
+		// a packed (WXF_HEAD::array) or numeric (WXF_HEAD::narray) array, dimension_array is copied.
+		// unsigned integers have no packed array type, they are always sent as a numeric array.
+		// it is Null if the size of arr does not match the dimensions
+		template<typename T>
+			requires (array_num_type<T>(WXF_HEAD::narray) >= 0)
+		template_arg(const std::span<const T> arr, const std::span<const size_t> dimension_array,
+			const WXF_HEAD t = WXF_HEAD::array)
+			: type(array_num_type<T>(t) < 0 ? WXF_HEAD::narray : t), num_type((uint8_t)array_num_type<T>(type)),
+			rank((int)dimension_array.size()), length(arr.size() * sizeof(T)), data((const uint8_t*)arr.data()) {
+			size_t all_len = 1;
+			for (auto dim : dimension_array)
+				all_len *= dim;
+			if (all_len != arr.size()) {
+				std::cerr << "template_arg: Data size does not match the dimension array." << std::endl;
+				*this = template_arg();
+				return;
+			}
+			if (rank <= inline_rank) {
+				std::copy(dimension_array.begin(), dimension_array.end(), dimensions);
+			}
+			else {
+				std::shared_ptr<size_t[]> dims(new size_t[rank]);
+				std::copy(dimension_array.begin(), dimension_array.end(), dims.get());
+				more_dimensions = std::move(dims);
+			}
+		}
+
+		template<typename T>
+		template_arg(const std::vector<T>& arr, const std::vector<size_t>& dimension_array,
+			const WXF_HEAD t = WXF_HEAD::array)
+			: template_arg(std::span<const T>(arr), std::span<const size_t>(dimension_array), t) {
+		}
+		template<typename T>
+		template_arg(std::vector<T>&&, const std::vector<size_t>&, const WXF_HEAD = WXF_HEAD::array) = delete;
+
+		// an encoded expression, e.g. the buffer of an Encoder
+		static template_arg encoded_bytes(const std::span<const uint8_t> bytes) {
+			template_arg arg;
+			arg.encoded = true;
+			arg.length = bytes.size();
+			arg.data = bytes.data();
+			return arg;
+		}
+		template_arg(const Encoder& encoder) : template_arg(encoded_bytes(encoder.buffer)) {}
+		template_arg(Encoder&&) = delete;
+
+		static template_arg symbol(const std::string_view sym) { return template_arg(sym, WXF_HEAD::symbol); }
+
+		// the arguments of a sequence placeholder #xxx...
+		static template_arg sequence_of(const std::span<const template_arg> items) {
+			template_arg arg;
+			arg.sequence = true;
+			arg.length = items.size();
+			arg.data = (const uint8_t*)items.data();
+			return arg;
 		}
-	};
 
-	struct expression {
-		atom_expression head_;
-		std::vector<expression> args_;
+		size_t sequence_size() const { return sequence ? length : 1; }
 
-		expression(const atom_expression& head) : head_(head), args_() {}
-		expression(const atom_expression& head, const std::vector<expression>& args) : head_(head), args_(args) {}
-		bool is_atom() const { return args_.size() == 0; }
+		std::span<const size_t> dimension_array() const {
+			return std::span<const size_t>(rank <= inline_rank ? dimensions : more_dimensions.get(), rank);
+		}
 
-		std::string to_FullForm() const {
-			if (is_atom()) {
-				return head_.to_FullForm();
+		template<typename EncoderType>
+		void push_to(EncoderType& encoder) const {
+			if (sequence) {
+				for (auto& item : std::span<const template_arg>((const template_arg*)data, length))
+					item.push_to(encoder);
+				return;
 			}
-			else {
-				std::string result = head_.to_FullForm() + "[";
-				for (size_t i = 0; i < args_.size(); ++i) {
-					result += args_[i].to_FullForm();
-					if (i + 1 < args_.size()) {
-						result += ", ";
-					}
-				}
-				result += "]";
-				return result;
+			if (encoded) {
+				encoder.push_ustr(data, length);
+				return;
+			}
+			switch (type) {
+			case WXF_HEAD::i64:
+				encoder.push_integer(integer);
+				break;
+			case WXF_HEAD::f64:
+				encoder.push_real(real);
+				break;
+			case WXF_HEAD::bigint:
+				if (data == nullptr)
+					encoder.push_bigint(std::to_string(big_integer));
+				else
+					encoder.push_string(std::string_view((const char*)data, length), type);
+				break;
+			case WXF_HEAD::array:
+			case WXF_HEAD::narray:
+				encoder.push_array_info(dimension_array(), type, num_type);
+				encoder.write(data, length);
+				break;
+			default:
+				encoder.push_string(std::string_view((const char*)data, length), type);
+				break;
 			}
 		}
-	};
 
-	struct parser {
-		lexer lexer_;
-		lexer::token currentToken_;
+		// the encoded size in bytes, without encoding
+		size_t size() const {
+			if (sequence) {
+				size_t res = 0;
+				for (auto& item : std::span<const template_arg>((const template_arg*)data, length))
+					res += item.size();
+				return res;
+			}
+			if (encoded)
+				return length;
+			switch (type) {
+			case WXF_HEAD::i64:
+				return 1 + (size_t(1) << minimal_signed_bits(integer));
+			case WXF_HEAD::f64:
+				return 9;
+			case WXF_HEAD::bigint:
+				// above INT64_MAX there are 19 or 20 digits
+				if (data == nullptr)
+					return 2 + (big_integer >= 10000000000000000000ull ? 20 : 19);
+				return 1 + varint_size(length) + length;
+			case WXF_HEAD::array:
+			case WXF_HEAD::narray: {
+				size_t res = 2 + varint_size(rank) + length;
+				for (auto dim : dimension_array())
+					res += varint_size(dim);
+				return res;
+			}
+			default:
+				return 1 + varint_size(length) + length;
+			}
+		}
+	};
 
-		void consume(lexer::token_type expected) {
-			if (currentToken_.type == expected) {
-				currentToken_ = lexer_.nextToken();
+	// the argument counts of the functions with sequences in one pass over the holes:
+	// counts[i] for the count hole i, which comes before its sequences. small templates keep them on the stack
+	struct template_counts {
+		static constexpr size_t small_size = 32;
+		size_t small[small_size];
+		std::unique_ptr<size_t[]> large;
+		size_t* counts = small;
+		size_t num_parts = 0; // the parts pushed by the placeholders
+
+		template<typename G>
+		template_counts(const std::span<const template_hole> holes, G&& sequence_size) {
+			if (holes.size() > small_size) {
+				large.reset(new size_t[holes.size()]);
+				counts = large.get();
 			}
-			else {
-				std::cerr << "Parse Error: Unexpected token '" << currentToken_.value
-					<< "', expected " << static_cast<int>(expected)
-					<< " at position " << currentToken_.position << std::endl;
+			for (size_t i = 0; i < holes.size(); i++) {
+				auto& h = holes[i];
+				if (h.kind == template_hole::count) {
+					counts[i] = h.base;
+				}
+				else if (h.kind == template_hole::sequence) {
+					size_t n = sequence_size(h.slot);
+					counts[h.base] += n;
+					num_parts += n;
+				}
+				else {
+					num_parts++;
+				}
 			}
 		}
 
-		atom_expression parse_atom() {
-			std::string value = currentToken_.value;
+		~template_counts() = default;
+		template_counts(const template_counts&) = delete;
+		template_counts& operator=(const template_counts&) = delete;
 
-			switch (currentToken_.type) {
-			case lexer::IDENTIFIER: {
-				consume(lexer::IDENTIFIER);
-				return atom_expression(atom_type::Symbol, value);
+		size_t operator[](const size_t i) const { return counts[i]; }
+	};
+
+	// copy the constant bytes of a compiled template, and call fill(encoder, slot) for each placeholder,
+	// for a sequence it pushes sequence_size(slot) expressions
+	template<typename EncoderType, typename F, typename G>
+	void instantiate_template(EncoderType& encoder, const std::span<const uint8_t> bytes,
+		const std::span<const template_hole> holes, F&& fill, G&& sequence_size) {
+		// the template is one expression, and the placeholders push its parts
+		template_counts counts(holes, sequence_size);
+		encoder.on_value();
+		encoder.on_container(counts.num_parts);
+
+		size_t pos = 0;
+		for (size_t i = 0; i < holes.size(); i++) {
+			auto& h = holes[i];
+			encoder.write(bytes.data() + pos, h.offset - pos);
+			pos = h.offset;
+			if (h.kind == template_hole::count)
+				encoder.write_varint(counts[i]);
+			else
+				fill(encoder, h.slot);
+		}
+		encoder.write(bytes.data() + pos, bytes.size() - pos);
+	}
+
+	// the size of a compiled template when the placeholder names[slot] takes arg_size(slot) bytes
+	// (all the expressions of a sequence) and a sequence has sequence_size(slot) expressions
+	template<typename F, typename G>
+	size_t template_size(const size_t num_bytes, const std::span<const template_hole> holes, F&& arg_size, G&& sequence_size) {
+		size_t res = num_bytes;
+		template_counts counts(holes, sequence_size);
+		for (size_t i = 0; i < holes.size(); i++) {
+			auto& h = holes[i];
+			if (h.kind == template_hole::count)
+				res += varint_size(counts[i]);
+			else
+				res += arg_size(h.slot);
+		}
+		return res;
+	}
+
+	// for templates without sequences
+	inline size_t no_sequence(size_t) {
+		std::cerr << "Error: the template has sequences, but no sequence sizes are given." << std::endl;
+		return 0;
+	}
+
+	// a FullForm template compiled once: all the constant bytes (heads, literals, argument counts) are
+	// precomputed, so an instantiation only copies them and fills the placeholders in between,
+	// without parsing or allocating
+	struct CompiledTemplate {
+		using hole = template_hole;
+		std::vector<uint8_t> bytes; // the constant parts, without the WXF head
+		std::vector<hole> holes;    // sorted by offset
+		std::vector<std::string> names;
+
+		CompiledTemplate() = default;
+		~CompiledTemplate() = default;
+		CompiledTemplate(const CompiledTemplate&) = default;
+		CompiledTemplate& operator=(const CompiledTemplate&) = default;
+		CompiledTemplate(CompiledTemplate&&) = default;
+		CompiledTemplate& operator=(CompiledTemplate&&) = default;
+
+		explicit CompiledTemplate(const FullForm::expression& expr) {
+			Encoder encoder;
+			compile(encoder, expr, false);
+			bytes = std::move(encoder.buffer);
+		}
+
+		void add_hole(const size_t offset, const std::string& name, const hole::kind_type kind, const size_t base) {
+			auto id = slot(name);
+			if (id < 0) {
+				id = (int)names.size();
+				names.push_back(name);
 			}
-			case lexer::EXPRESSION: {
-				consume(lexer::EXPRESSION);
-				return atom_expression(atom_type::Expression, value);
+			hole h;
+			h.offset = offset;
+			h.slot = (size_t)id;
+			h.kind = kind;
+			h.base = base;
+			holes.push_back(h);
+		}
+
+		static bool is_sequence(const FullForm::expression& expr) {
+			return expr.is_atom() && expr.head_.get_type() == FullForm::atom_type::Expression
+				&& expr.head_.get_value().ends_with("...");
+		}
+
+		// like encode_fullform, but the functions with sequences get a count hole
+		void compile(Encoder& encoder, const FullForm::expression& expr, const bool is_argument) {
+			if (expr.is_atom()) {
+				if (is_sequence(expr) && !is_argument)
+					std::cerr << "Error: the sequence " << expr.head_.get_value() << " is not an argument." << std::endl;
+				encode_fullform(encoder, expr, [&](Encoder& enc, const std::string& name) {
+					add_hole(enc.buffer.size(), name, hole::value, 0);
+					});
+				return;
 			}
-			case lexer::INTEGER: {
-				consume(lexer::INTEGER);
-				return atom_expression(atom_type::Integer, value);
+
+			size_t len = expr.args_.size();
+			if (expr.args_[0].is_atom() &&
+				expr.args_[0].head_.get_type() == FullForm::atom_type::Null) {
+				len = 0;
 			}
-			case lexer::REAL: {
-				consume(lexer::REAL);
-				return atom_expression(atom_type::Real, value);
+			size_t num_sequences = 0;
+			for (size_t i = 0; i < len; i++)
+				num_sequences += is_sequence(expr.args_[i]);
+
+			size_t count_hole = holes.size();
+			if (num_sequences == 0) {
+				encoder.push_function(expr.head_.get_value(), len);
 			}
-			case lexer::STRING: {
-				consume(lexer::STRING);
-				return atom_expression(atom_type::String, value);
+			else {
+				encoder.put((uint8_t)WXF_HEAD::func);
+				hole h;
+				h.offset = encoder.buffer.size();
+				h.kind = hole::count;
+				h.base = len - num_sequences;
+				holes.push_back(h);
+				encoder.push_symbol(expr.head_.get_value());
 			}
-			default:
-				std::cerr << "Parse Error: Unexpected token '" << currentToken_.value
-					<< "' at position " << currentToken_.position << std::endl;
-				return atom_expression(atom_type::Null, "");
+
+			for (size_t i = 0; i < len; i++) {
+				if (is_sequence(expr.args_[i]))
+					add_hole(encoder.buffer.size(), expr.args_[i].head_.get_value(), hole::sequence, count_hole);
+				else
+					compile(encoder, expr.args_[i], true);
 			}
 		}
 
-		expression parse_expression() {
-			atom_expression head = parse_atom();
+		explicit CompiledTemplate(const std::string_view ff_template)
+			: CompiledTemplate(FullForm::parse_FullForm(ff_template)) {
+		}
 
-			if (currentToken_.type == lexer::LBRACKET) {
-				consume(lexer::LBRACKET);
-				std::vector<expression> args;
+		// the slot of a placeholder, -1 if it is not in the template
+		int slot(const std::string_view name) const {
+			for (size_t i = 0; i < names.size(); i++)
+				if (names[i] == name)
+					return (int)i;
+			return -1;
+		}
 
-				if (currentToken_.type != lexer::RBRACKET) {
-					args.push_back(parse_expression());
+		// fill(encoder, slot) pushes the expression of the placeholder names[slot],
+		// or the sequence_size(slot) expressions of a sequence #xxx...
+		template<typename EncoderType, typename F, typename G = size_t(*)(size_t)>
+			requires std::invocable<F&, EncoderType&, size_t>
+		void instantiate(EncoderType& encoder, F&& fill, G&& sequence_size = no_sequence) const {
+			instantiate_template(encoder, std::span<const uint8_t>(bytes), std::span<const hole>(holes), fill, sequence_size);
+		}
 
-					while (currentToken_.type == lexer::COMMA) {
-						consume(lexer::COMMA);
-						args.push_back(parse_expression());
-					}
-				}
+		bool check_args(const std::span<const template_arg> args) const {
+			if (args.size() < names.size()) {
+				std::cerr << "Error: the template has " << names.size() << " placeholders but "
+					<< args.size() << " arguments are given." << std::endl;
+				return false;
+			}
+			return true;
+		}
 
-				// if we meet expr like f[], we use a null atom as argument
-				if (args.size() == 0) {
-					args.push_back(expression(atom_expression(atom_type::Null, "")));
-				}
+		// args[slot] is the value of names[slot], nothing is pushed if there are too few of them
+		template<typename EncoderType>
+		void instantiate(EncoderType& encoder, const std::span<const template_arg> args) const {
+			if (!check_args(args))
+				return;
+			instantiate(encoder, [&](EncoderType& enc, size_t slot) { args[slot].push_to(enc); },
+				[&](size_t slot) { return args[slot].sequence_size(); });
+		}
 
-				consume(lexer::RBRACKET);
-				return expression(head, args);
-			}
+		template<typename EncoderType>
+		void instantiate(EncoderType& encoder, const std::initializer_list<template_arg> args) const {
+			instantiate(encoder, std::span<const template_arg>(args.begin(), args.size()));
+		}
 
-			return head;
+		// the encoded size with args, 0 if there are too few of them
+		size_t size(const std::span<const template_arg> args) const {
+			if (!check_args(args))
+				return 0;
+			return template_size(bytes.size(), std::span<const hole>(holes), [&](size_t slot) { return args[slot].size(); },
+				[&](size_t slot) { return args[slot].sequence_size(); });
 		}
+	};
 
-		parser(const std::string_view input) : lexer_(input) {
-			currentToken_ = lexer_.nextToken();
+	// a template compiled at compile time, see static_template
+	template<size_t NumBytes, size_t NumHoles, size_t NumSlots>
+	struct StaticTemplate {
+		using hole = template_hole;
+		std::array<uint8_t, NumBytes> bytes = {};
+		std::array<hole, NumHoles> holes = {};
+		std::array<std::string_view, NumSlots> names = {};
+
+		constexpr int slot(const std::string_view name) const {
+			for (size_t i = 0; i < NumSlots; i++)
+				if (names[i] == name)
+					return (int)i;
+			return -1;
 		}
 
-		expression parse() {
-			expression result = parse_expression();
+		template<typename EncoderType, typename F, typename G = size_t(*)(size_t)>
+			requires std::invocable<F&, EncoderType&, size_t>
+		void instantiate(EncoderType& encoder, F&& fill, G&& sequence_size = no_sequence) const {
+			instantiate_template(encoder, std::span<const uint8_t>(bytes), std::span<const hole>(holes), fill, sequence_size);
+		}
 
-			if (currentToken_.type != lexer::END) {
-				std::cerr << "Parse Error: Unexpected token at end: " << currentToken_.value << std::endl;
-			}
+		template<typename EncoderType>
+		void instantiate(EncoderType& encoder, const std::span<const template_arg, NumSlots> args) const {
+			instantiate(encoder, [&](EncoderType& enc, size_t slot) { args[slot].push_to(enc); },
+				[&](size_t slot) { return args[slot].sequence_size(); });
+		}
 
-			return result;
+		size_t size(const std::span<const template_arg, NumSlots> args) const {
+			return template_size(NumBytes, std::span<const hole>(holes), [&](size_t slot) { return args[slot].size(); },
+				[&](size_t slot) { return args[slot].sequence_size(); });
 		}
-	};
 
-	// we allow use { }, so we need to convert { } to List[ ]
-	inline expression parse_FullForm(const std::string_view str) {
-		std::string mod_str;
-		mod_str.reserve(str.size() + 10);
-		for (auto c : str) {
-			if (c == '{')
-				mod_str += "List[";
-			else if (c == '}')
-				mod_str += "]";
-			else
-				mod_str += c;
+		// a template without placeholders is a single copy
+		template<typename EncoderType>
+			requires (NumHoles == 0)
+		void instantiate(EncoderType& encoder) const {
+			encoder.on_value();
+			encoder.write(bytes.data(), NumBytes);
 		}
+	};
 
-		parser parser(mod_str);
-		return parser.parse();
+	template<FullForm::fixed_string Str>
+	consteval auto compile_fullform() {
+		// the first pass for the sizes, the second one fills them
+		constexpr auto sizes = [] {
+			FullForm::static_compiler compiler(Str.view());
+			compiler.run();
+			size_t num_slots = 0;
+			for (size_t i = 0; i < compiler.hole_names.size(); i++)
+				if (compiler.holes[i].kind != template_hole::count
+					&& std::find(compiler.hole_names.begin(), compiler.hole_names.begin() + i, compiler.hole_names[i])
+					== compiler.hole_names.begin() + i)
+					num_slots++;
+			return std::array<size_t, 3>{ compiler.bytes.size(), compiler.holes.size(), num_slots };
+			}();
+
+		StaticTemplate<sizes[0], sizes[1], sizes[2]> res;
+		FullForm::static_compiler compiler(Str.view());
+		compiler.run();
+		std::copy(compiler.bytes.begin(), compiler.bytes.end(), res.bytes.begin());
+		size_t num_slots = 0;
+		for (size_t i = 0; i < sizes[1]; i++) {
+			res.holes[i] = compiler.holes[i];
+			if (compiler.holes[i].kind == template_hole::count)
+				continue;
+			auto id = res.slot(compiler.hole_names[i]);
+			if (id < 0) {
+				id = (int)num_slots;
+				res.names[num_slots++] = compiler.hole_names[i];
+			}
+			res.holes[i].slot = (size_t)id;
+		}
+		return res;
 	}
-} // namespace WXF_PARSER::FullForm
 
-namespace WXF_PARSER {
-	// we allow use a map to store function that generating sub-expressions
-	inline void fullform_to_wxf(Encoder& encoder, const FullForm::expression& expr,
-		const std::unordered_map<std::string, std::function<void(Encoder&)>>& map) {
+	// a FullForm literal compiled to WXF bytes at compile time, a malformed template fails to compile:
+	// constexpr auto& tmpl = WXF_PARSER::static_template<"SparseArray[Automatic,#dims,0,{1,{#rowptr,#colindex},#vals}]">;
+	// tmpl.instantiate(encoder, [&](auto& enc, size_t slot) { ... }); where slot is tmpl.slot("#dims"), ...
+	template<FullForm::fixed_string Str>
+	inline constexpr auto static_template = compile_fullform<Str>();
+
+	// the values of a placeholder over a batch of rows, see instantiate_batch.
+	// the data is only referenced
+	struct template_column {
+		enum kind_type : uint8_t {
+			constant, // value in every row
+			integers,
+			reals,
+			strings,
+			arrays    // row r is elements [r * n, (r + 1) * n) of the data, value gives their type and dimensions
+		};
+		kind_type kind = constant;
+		template_arg value;
+		const void* data = nullptr;
+		size_t row_size = 0; // for arrays, in bytes
+		size_t num_rows = SIZE_MAX; // the rows the data holds, any number for a constant
+
+		template_column() = default;
+		template_column(const template_arg& val) : value(val) {}
+		template_column(const std::span<const int64_t> column)
+			: kind(integers), data(column.data()), num_rows(column.size()) {
+		}
+		template_column(const std::span<const double> column)
+			: kind(reals), data(column.data()), num_rows(column.size()) {
+		}
+		template_column(const std::span<const std::string_view> column, const WXF_HEAD type = WXF_HEAD::string)
+			: kind(strings), value(std::string_view(), type), data(column.data()), num_rows(column.size()) {
+		}
+		// the data is referenced, a temporary column would dangle
+		template<typename T>
+		template_column(std::vector<T>&&, const WXF_HEAD = WXF_HEAD::string) = delete;
 
-		if (expr.is_atom()) {
-			switch (expr.head_.get_type()) {
-			case FullForm::atom_type::Integer:
-				encoder.push_integer(std::stoll(expr.head_.get_value()));
-				break;
-			case FullForm::atom_type::Real:
-				encoder.push_real(std::stod(expr.head_.get_value()));
-				break;
-			case FullForm::atom_type::String:
-				encoder.push_string(expr.head_.get_value());
+		template<typename T>
+		static template_column arrays_of(const std::span<const T> column, const std::vector<size_t>& row_dimensions,
+			const WXF_HEAD type = WXF_HEAD::array) {
+			template_column res;
+			size_t n = 1;
+			for (auto dim : row_dimensions)
+				n *= dim;
+			res.kind = arrays;
+			res.value = template_arg(column.first(std::min(n, column.size())), std::span<const size_t>(row_dimensions), type);
+			res.data = column.data();
+			res.row_size = n * sizeof(T);
+			res.num_rows = n == 0 ? SIZE_MAX : column.size() / n;
+			return res;
+		}
+
+		template_arg at(const size_t row) const {
+			switch (kind) {
+			case integers:
+				return template_arg(((const int64_t*)data)[row]);
+			case reals:
+				return template_arg(((const double*)data)[row]);
+			case strings:
+				return template_arg(((const std::string_view*)data)[row], value.type);
+			case arrays: {
+				auto arg = value;
+				arg.data = (const uint8_t*)data + row * row_size;
+				arg.length = row_size;
+				return arg;
+			}
+			default:
+				return value;
+			}
+		}
+
+		// the same as at(row).size() and at(row).push_to(encoder), without building the template_arg
+		size_t size(const size_t row) const {
+			switch (kind) {
+			case integers:
+				return 1 + (size_t(1) << minimal_signed_bits(((const int64_t*)data)[row]));
+			case reals:
+				return 9;
+			case strings: {
+				auto len = ((const std::string_view*)data)[row].size();
+				return 1 + varint_size(len) + len;
+			}
+			default:
+				return value.size();
+			}
+		}
+
+		template<typename EncoderType>
+		void push_to(EncoderType& encoder, const size_t row) const {
+			switch (kind) {
+			case integers:
+				encoder.push_integer(((const int64_t*)data)[row]);
 				break;
-			case FullForm::atom_type::Symbol:
-				encoder.push_symbol(expr.head_.get_value());
+			case reals:
+				encoder.push_real(((const double*)data)[row]);
 				break;
-			case FullForm::atom_type::Null:
+			case strings:
+				encoder.push_string(((const std::string_view*)data)[row], value.type);
 				break;
-			case FullForm::atom_type::Expression: {
-				auto& vv = expr.head_.get_value();
-				auto it = map.find(vv);
-				if (it != map.end())
-					it->second(encoder);
-				else
-					std::cerr << "Error: expression id " << vv << " not found in map." << std::endl;
+			case arrays: {
+				auto arg = value;
+				arg.data = (const uint8_t*)data + row * row_size;
+				arg.push_to(encoder);
 				break;
 			}
 			default:
-				std::cerr << "Error: unknown atom type." << std::endl;
+				value.push_to(encoder);
 				break;
 			}
 		}
-		else {
-			size_t len = expr.args_.size();
-			if (expr.args_[0].is_atom() &&
-				expr.args_[0].head_.get_type() == FullForm::atom_type::Null) {
-				len = 0;
-			}
-			std::string_view name = expr.head_.get_value();
 
-			// Rule or DelayRule is not special in FullForm, we treat them as normal functions
-			encoder.push_function(name, len);
+		size_t sequence_size() const { return kind == constant ? value.sequence_size() : 1; }
+	};
 
-			for (size_t i = 0; i < len; i++) {
-				fullform_to_wxf(encoder, expr.args_[i], map);
+	// the messages of a batch, message r is buffer[offsets[r], offsets[r + 1])
+	struct template_batch {
+		std::vector<uint8_t> buffer;
+		std::vector<size_t> offsets;
+
+		size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+		std::span<const uint8_t> operator[](const size_t r) const {
+			return std::span<const uint8_t>(buffer.data() + offsets[r], offsets[r + 1] - offsets[r]);
+		}
+	};
+
+	// instantiate a compiled template (CompiledTemplate or static_template) for num_rows rows, where
+	// columns[slot] gives the value of names[slot] in each row. the rows are split over num_threads threads
+	// (0 for all cores): a first pass computes the size of every message, and after the prefix sum
+	// each row is written by a SpanEncoder at its offset of one buffer
+	template<typename TemplateType>
+	template_batch instantiate_batch(const TemplateType& tmpl, const std::span<const template_column> columns,
+		const size_t num_rows, const bool include_head = true, unsigned num_threads = 0) {
+		template_batch res;
+		const size_t num_slots = tmpl.names.size();
+		if (columns.size() < num_slots) {
+			std::cerr << "instantiate_batch: the template has " << num_slots << " placeholders but "
+				<< columns.size() << " columns are given." << std::endl;
+			return res;
+		}
+		for (size_t i = 0; i < num_slots; i++) {
+			if (columns[i].num_rows < num_rows) {
+				std::cerr << "instantiate_batch: the column of " << tmpl.names[i] << " has only "
+					<< columns[i].num_rows << " rows, " << num_rows << " are needed." << std::endl;
+				return res;
 			}
 		}
-	}
+		const size_t head_size = include_head ? 2 : 0;
+		res.offsets.resize(num_rows + 1);
+
+		// run f(row) for all rows
+		const size_t num_chunks = parallel_chunks(num_rows, num_threads);
+		auto for_rows = [&](auto&& f) {
+			parallel_for(num_chunks, num_threads, [&](size_t c) {
+				for (size_t r = num_rows * c / num_chunks; r < num_rows * (c + 1) / num_chunks; r++)
+					f(r);
+				});
+			};
 
-	inline void fullform_to_wxf(Encoder& encoder, const FullForm::expression& expr,
-		const std::unordered_map<std::string, Encoder>& map) {
-		std::unordered_map<std::string, std::function<void(Encoder&)>> func_map;
-		for (const auto& [key, value] : map) {
-			func_map[key] = [&value](Encoder& enc) {
-				enc.push_ustr(value.buffer);
-				};
+		auto sequence_size = [&](size_t slot) { return columns[slot].sequence_size(); };
+		for_rows([&](size_t r) {
+			res.offsets[r + 1] = head_size + template_size(tmpl.bytes.size(), std::span<const template_hole>(tmpl.holes),
+				[&](size_t slot) { return columns[slot].size(r); }, sequence_size);
+			});
+		for (size_t r = 0; r < num_rows; r++)
+			res.offsets[r + 1] += res.offsets[r];
+
+		res.buffer.resize(res.offsets[num_rows]);
+		// a row must fill exactly the size computed for it, otherwise the messages would overlap or have gaps
+		std::atomic<size_t> bad_row = SIZE_MAX;
+		for_rows([&](size_t r) {
+			SpanEncoder encoder(res.buffer.data() + res.offsets[r], res.offsets[r + 1] - res.offsets[r]);
+			if (include_head) {
+				encoder.put(56); // WXF head
+				encoder.put(58); // WXF head
+			}
+			tmpl.instantiate(encoder, [&](SpanEncoder& enc, size_t slot) { columns[slot].push_to(enc, r); },
+				sequence_size);
+			if (encoder.overflow() || encoder.size != encoder.out.size())
+				bad_row = r;
+			});
+		if (bad_row != SIZE_MAX) {
+			std::cerr << "instantiate_batch: row " << bad_row << " does not match its computed size." << std::endl;
+			return template_batch();
 		}
-		fullform_to_wxf(encoder, expr, func_map);
+		return res;
+	}
+
+	// the number of expressions in encoded bytes, e.g. the arguments pushed for a sequence #xxx...
+	inline size_t count_expressions(const std::span<const uint8_t> bytes) {
+		Cursor cursor(bytes.data(), bytes.size());
+		cursor.check_head = false;
+		size_t n = 0;
+		while (cursor.next() && cursor.skip())
+			n++;
+		return n;
 	}
 
+	// a sequence #xxx... in the map is encoded (or given) as all of its arguments in one buffer,
+	// and its size is the number of expressions there
 	template<typename MapType>
-	Encoder fullform_to_wxf(const std::string_view ff_template, const MapType& map, bool include_head = true) {
+	Encoder fullform_to_wxf(const CompiledTemplate& tmpl, const MapType& map, bool include_head = true) {
 		Encoder encoder;
-		encoder.buffer.reserve(ff_template.size() * 32); // reserve some space
-		if (include_head) {
-			encoder.buffer.push_back(56); // WXF head
-			encoder.buffer.push_back(58); // WXF head
+		const size_t num_slots = tmpl.names.size();
+		std::vector<bool> is_sequence(num_slots, false);
+		for (auto& h : tmpl.holes)
+			if (h.kind == template_hole::sequence)
+				is_sequence[h.slot] = true;
+
+		auto find = [&](size_t slot) {
+			auto it = map.find(tmpl.names[slot]);
+			if (it == map.end())
+				std::cerr << "Error: expression id " << tmpl.names[slot] << " not found in map." << std::endl;
+			return it;
+			};
+		// the missing ones are Null
+		std::vector<size_t> sequence_sizes(num_slots, 1);
+		auto sequence_size = [&](size_t slot) { return sequence_sizes[slot]; };
+
+		if constexpr (std::is_same_v<MapType, std::unordered_map<std::string, Encoder>>) {
+			// one lookup per placeholder, then the encoded sub-expressions are bound by slot
+			// and the size is known exactly
+			std::vector<const Encoder*> found(num_slots, nullptr);
+			for (size_t slot = 0; slot < num_slots; slot++) {
+				auto it = find(slot);
+				if (it == map.end())
+					continue;
+				found[slot] = &it->second;
+				if (is_sequence[slot])
+					sequence_sizes[slot] = count_expressions(it->second.buffer);
+			}
+			encoder.reserve(template_size(tmpl.bytes.size(), std::span<const template_hole>(tmpl.holes),
+				[&](size_t slot) { return found[slot] ? found[slot]->buffer.size() : symbols::Null.size; },
+				sequence_size) + 2);
+			if (include_head) {
+				encoder.buffer.push_back(56); // WXF head
+				encoder.buffer.push_back(58); // WXF head
+			}
+			tmpl.instantiate(encoder, [&](Encoder& enc, size_t slot) {
+				if (found[slot])
+					enc.push_ustr(found[slot]->buffer);
+				else
+					enc.push_symbol(symbols::Null);
+				}, sequence_size);
+		}
+		else {
+			// the sequences are encoded first for their sizes
+			std::vector<Encoder> sequences(num_slots);
+			for (size_t slot = 0; slot < num_slots; slot++) {
+				if (!is_sequence[slot])
+					continue;
+				auto it = find(slot);
+				if (it == map.end()) {
+					sequences[slot].push_symbol(symbols::Null);
+					continue;
+				}
+				it->second(sequences[slot]);
+				sequence_sizes[slot] = count_expressions(sequences[slot].buffer);
+			}
+			encoder.reserve(tmpl.bytes.size() * 2); // reserve some space
+			if (include_head) {
+				encoder.buffer.push_back(56); // WXF head
+				encoder.buffer.push_back(58); // WXF head
+			}
+			tmpl.instantiate(encoder, [&](Encoder& enc, size_t slot) {
+				if (is_sequence[slot]) {
+					enc.push_ustr(sequences[slot].buffer);
+					return;
+				}
+				auto it = find(slot);
+				if (it != map.end())
+					it->second(enc);
+				else
+					enc.push_symbol(symbols::Null);
+				}, sequence_size);
 		}
-		fullform_to_wxf(encoder, FullForm::parse_FullForm(ff_template), map);
 		return encoder;
 	}
-} // namespace WXF_PARSER
\ No newline at end of file
+
+	template<typename MapType>
+	Encoder fullform_to_wxf(const std::string_view ff_template, const MapType& map, bool include_head = true) {
+		return fullform_to_wxf(CompiledTemplate(ff_template), map, include_head);
+	}
+} // namespace WXF_PARSER